@@ -0,0 +1,88 @@
+/*
+** capture.c -- record connection traffic to a compact binary file
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "capture.h"
+
+/*** Data ***/
+int capture_enabled = 0;
+
+static FILE *capture_file = NULL;
+static int capture_flags;
+static uint64_t capture_origin;
+static uint32_t capture_next = 0;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void capture_stop(void) {
+    pthread_mutex_lock(&capture_lock);
+    capture_enabled = 0;
+    fclose(capture_file);
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/*
+ * Start capturing into path, with message payloads if payloads is set.
+ * returns 0 on success, -1 on failure.
+ */
+int capture_start(const char *path, int payloads) {
+    struct capture_header header = { CAPTURE_MAGIC, CAPTURE_VERSION, payloads ? CAPTURE_PAYLOADS : 0 };
+
+    if ((capture_file = fopen(path, "wb")) == NULL) return -1;
+    if (fwrite(&header, sizeof header, 1, capture_file) != 1) return -1;
+
+    capture_flags = header.flags;
+    capture_origin = now_ns();
+    atexit(capture_stop);
+    capture_enabled = 1;
+
+    return 0;
+}
+
+/*
+ * Record a new connection.
+ * returns its capture id.
+ */
+uint32_t capture_open(void) {
+    uint32_t conn = __atomic_add_fetch(&capture_next, 1, __ATOMIC_RELAXED);
+
+    capture_event(conn, CAPTURE_OPEN, NULL, 0);
+
+    return conn;
+}
+
+/*
+ * Append one record. Timestamps are taken under the lock, so the file is in time order.
+ */
+void capture_event(uint32_t conn, int type, const char *data, int len) {
+    struct capture_record record;
+
+    pthread_mutex_lock(&capture_lock);
+    if (!capture_enabled) {
+        pthread_mutex_unlock(&capture_lock);
+        return;
+    }
+
+    record.ts = now_ns() - capture_origin;
+    record.conn = conn;
+    record.len = len;
+    record.type = type;
+    fwrite(&record, sizeof record, 1, capture_file);
+    if ((capture_flags & CAPTURE_PAYLOADS) && len > 0) fwrite(data, 1, len, capture_file);
+
+    // Keep the file usable if the server dies
+    if (type == CAPTURE_CLOSE) fflush(capture_file);
+    pthread_mutex_unlock(&capture_lock);
+}
@@ -0,0 +1,42 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/*
+ * Traffic capture for offline replay.
+ * A header, then one record per event in time order, each followed by its
+ * payload when the capture was started with payloads.
+ */
+
+#define CAPTURE_MAGIC 0x50414345   // "ECAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_PAYLOADS 1          // header flag
+
+enum {
+    CAPTURE_OPEN,       // connection accepted
+    CAPTURE_CLOSE,      // connection closed
+    CAPTURE_IN,         // bytes received from the client
+    CAPTURE_OUT         // bytes written to the client, keepalives excluded
+};
+
+struct capture_header {
+    uint32_t        magic;
+    uint16_t        version;
+    uint16_t        flags;
+} __attribute__((packed));
+
+struct capture_record {
+    uint64_t        ts;         // ns since the capture started
+    uint32_t        conn;       // 1, 2, ... in order of acceptance
+    uint32_t        len;
+    uint8_t         type;
+} __attribute__((packed));
+
+extern int capture_enabled;
+
+extern int capture_start(const char *, int);
+extern uint32_t capture_open(void);
+extern void capture_event(uint32_t, int, const char *, int);
+
+#endif
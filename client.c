@@ -22,6 +22,11 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/un.h>
+
+/*** Headers ***/
+#include "shmring.h"
 
 /*** Defines ***/
 #define BUFFER 2048
@@ -35,39 +40,66 @@ typedef struct pthread_arg_t {
     struct sockaddr_in client_address;
 } pthread_arg_t;
 
+// Shared-memory transport, set up by attach_shm when running with -s
+struct shm_rings *shm = NULL;
+int shm_fds[SHM_NFDS];
+
 /*** Declarations ***/
 void *pthread_routine(void *arg);
+void *shm_routine(void *arg);
 int sendall(int s, char *buf, int *len);
+int shm_send(char *buf, int len);
+int connect_unix(const char *path);
+void attach_shm(int socket_fd);
 void disableRawMode();
 void enableRawMode();
 
 /*** Init ***/
 int main(int argc, char *argv[]){
-    if(argc != 2) {
-        printf("Invalid number of arguments, program usage: ./client port");
+    if(argc < 2 || argc > 4) {
+        printf("Invalid number of arguments, program usage: ./client port | ./client -u unix_socket_path [-s]");
         return 1;
     }
 
+	char *unix_path = NULL;
+	int use_shm = 0;
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "-u") == 0 && i + 1 < argc) unix_path = argv[++i];
+		else if(strcmp(argv[i], "-s") == 0) use_shm = 1;
+	}
+	if(use_shm && !unix_path){
+		printf("Shared memory (-s) needs a unix socket (-u unix_socket_path)");
+		return 1;
+	}
+
 	int port;
-	if((port = atoi(argv[1])) == 0 || port < 49152 || port > 65535){
+	if(!unix_path && ((port = atoi(argv[1])) == 0 || port < 49152 || port > 65535)){
         printf("Offset can only be a positive integer (49152 - 65535)");
 		return 1;
     }
 
     struct addrinfo hints;
-    struct addrinfo *servinfo;
+    struct addrinfo *servinfo = NULL;
+	int socket_fd;
 	
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;     // don't care IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
-    hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
+	if(unix_path){
+		socket_fd = connect_unix(unix_path);
+	}
+	else {
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = AF_UNSPEC;     // don't care IPv4 or IPv6
+		hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
+		hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
 
-    int status = getaddrinfo(NULL, argv[1], &hints, &servinfo);
-    check(status == 0);
+		int status = getaddrinfo(NULL, argv[1], &hints, &servinfo);
+		check(status == 0);
 
-    int socket_fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
-    check(socket_fd != -1);
-    check(connect(socket_fd, servinfo->ai_addr, servinfo->ai_addrlen) != -1);
+		socket_fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+		check(socket_fd != -1);
+		check(connect(socket_fd, servinfo->ai_addr, servinfo->ai_addrlen) != -1);
+	}
+	
+	if(use_shm) attach_shm(socket_fd);
 
 	pthread_attr_t pthread_attr;
 	check(pthread_attr_init(&pthread_attr) == 0);
@@ -87,7 +119,7 @@ int main(int argc, char *argv[]){
 
 	pthread_arg->socket_fd = socket_fd;
 	
-	if (pthread_create(&pthread, &pthread_attr, pthread_routine, (void *)pthread_arg) != 0) {
+	if (pthread_create(&pthread, &pthread_attr, shm ? shm_routine : pthread_routine, (void *)pthread_arg) != 0) {
         perror("pthread_create");
         free(pthread_arg);
 		exit(1);
@@ -101,7 +133,13 @@ int main(int argc, char *argv[]){
     while (read(STDIN_FILENO, &message, BUFFER) > 0){
 		message[strcspn(message, "\n")] = 0;
 		bytesleft = strlen(message);
-		if(sendall(socket_fd, message, &bytesleft) == -1) {
+		if(shm){
+			if(shm_send(message, bytesleft) == -1) {
+				printf("Unable to submit the message, terminating the program");
+				break;
+			}
+		}
+		else if(sendall(socket_fd, message, &bytesleft) == -1) {
 			printf("Unable to send the message, terminating the program, string length left unsent: %d", bytesleft);
 			break;
 		}
@@ -110,7 +148,7 @@ int main(int argc, char *argv[]){
 	
 	pthread_cancel(pthread);
 
-    freeaddrinfo(servinfo);
+    if(servinfo) freeaddrinfo(servinfo);
 
 	pthread_join(pthread, NULL);
 
@@ -146,8 +184,8 @@ void *pthread_routine(void *arg) {
 	char message_reply[BUFFER] = {};
 	while(1){
 		recv_status = recv(socket_fd, &message_reply, BUFFER, 0);
-		if(strlen(message_reply) == 0) continue;
 		if(recv_status <= 0) break;
+		if(strlen(message_reply) == 0) continue;
 		printf("%d ", strlen(message_reply));
 		puts(message_reply);
 		fflush(stdout);
@@ -159,6 +197,51 @@ void *pthread_routine(void *arg) {
     return NULL;
 }
 
+/*
+ * Print the replies the server completes into shared memory.
+ * The socket is still watched, it carries keepalives and tells us when the server is gone.
+ */
+void *shm_routine(void *arg) {
+    pthread_arg_t *pthread_arg = (pthread_arg_t *)arg;
+    int socket_fd = pthread_arg->socket_fd;
+
+    free(arg);
+	
+	printf("Connected (shared memory).\n");
+	char message_reply[BUFFER] = {};
+	char keepalive[BUFFER];
+	uint64_t wakeups;
+	int len;
+	
+	struct pollfd fds[2];
+	fds[0].fd = socket_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = shm_fds[SHM_FD_TO_CLIENT];
+	fds[1].events = POLLIN;
+	
+	while(1){
+		while((len = shm_ring_read(&shm->complete, message_reply, BUFFER - 1)) > 0){
+			if(len > BUFFER - 1) len = BUFFER - 1;
+			message_reply[len] = '\0';
+			// Tell the server there is room again
+			shm_notify(shm_fds[SHM_FD_TO_SERVER]);
+			printf("%d ", len);
+			puts(message_reply);
+			fflush(stdout);
+		}
+		
+		if(poll(fds, 2, -1) == -1) break;
+		if(fds[1].revents & POLLIN) read(fds[1].fd, &wakeups, sizeof wakeups);
+		if(fds[0].revents & (POLLIN | POLLHUP | POLLERR)){
+			if(recv(socket_fd, keepalive, BUFFER, 0) <= 0) break;
+		}
+	}
+	printf("Lost connection to the server.\n");
+    close(socket_fd);
+	
+    return NULL;
+}
+
 /*** Communication ***/
 int sendall(int s, char *buf, int *len) {
     int total = 0;        // how many bytes we've sent
@@ -182,3 +265,41 @@ int sendall(int s, char *buf, int *len) {
     return n==-1?-1:0; // return -1 on failure, 0 on success
 }
 
+/*
+ * Submit a message through shared memory, retrying while the ring is full.
+ */
+int shm_send(char *buf, int len) {
+	for(int tries = 0; shm_ring_write(&shm->submit, buf, len) == -1; tries++){
+		if(tries == 2000) return -1;    // ~2 s, like the socket send timeout
+		usleep(1000);
+	}
+	shm_notify(shm_fds[SHM_FD_TO_SERVER]);
+	
+	return 0;
+}
+
+/*** Local transports ***/
+int connect_unix(const char *path) {
+	struct sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	check(strlen(path) < sizeof address.sun_path);
+	strcpy(address.sun_path, path);
+	
+	int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	check(socket_fd != -1);
+	check(connect(socket_fd, (struct sockaddr *)&address, sizeof address) != -1);
+	
+	return socket_fd;
+}
+
+/*
+ * Ask the server for a ring pair and map it.
+ */
+void attach_shm(int socket_fd) {
+	int len = strlen("/shm");
+	
+	check(sendall(socket_fd, "/shm", &len) != -1);
+	check(shm_recv_fds(socket_fd, shm_fds) != -1);
+	check((shm = shm_rings_map(shm_fds[SHM_FD_MEM])) != NULL);
+	close(shm_fds[SHM_FD_MEM]);
+}
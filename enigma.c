@@ -69,10 +69,13 @@ C           FVPJIAOYEDRZXWGCTKUQSBNMHL
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #define ROTATE 26
+#define BYTES 256
 
 #include "enigma.h"
+#include "trace.h"
 
 const char *alpha = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 const char *rotor_ciphers[] = {
@@ -100,7 +103,6 @@ const char *reflectors[] = {
  * Produce a rotor object
  * Setup the correct offset, cipher set and turn overs.
  */
- /*
 struct Rotor new_rotor(struct Enigma *machine, int rotornumber, int offset) {
     struct Rotor r;
     r.offset = offset;
@@ -111,7 +113,35 @@ struct Rotor new_rotor(struct Enigma *machine, int rotornumber, int offset) {
     machine->numrotors++;
 
     return r;
-}//*/
+}
+
+/*
+ * Configure a machine from a textual key.
+ * rotors is the rotor order, e.g. "321", offsets the start positions, e.g. "AAA".
+ * Either may be NULL to take the default "321" / "AAA".
+ * returns 0 on success, -1 if the key is malformed.
+ */
+int enigma_parse_key(struct Enigma *machine, const char *rotors, const char *offsets) {
+    if (!rotors) rotors = "321";
+    if (!offsets) offsets = "AAA";
+
+    int n = strlen(rotors);
+    if (n < 1 || n > 8 || strlen(offsets) != n) return -1;
+
+    for (int i = 0; i < n; i++) {
+        if (rotors[i] < '1' || rotors[i] > '8') return -1;
+        if (str_index(alpha, toupper(offsets[i])) < 0) return -1;
+    }
+
+    memset(machine, 0, sizeof *machine);
+    machine->reflector = reflectors[1];
+    for (int i = 0; i < n; i++) {
+        machine->rotors[i] = new_rotor(machine, rotors[i] - '0',
+                                       str_index(alpha, toupper(offsets[i])));
+    }
+
+    return 0;
+}
 
 /*
  * Return the req_index position of a character inside a string
@@ -174,6 +204,297 @@ int rotor_reverse(struct Rotor *rotor, int req_index) {
 
 }
 
+/*
+ * Push a single letter through the plugboard, rotors and reflector.
+ */
+char encryptChar(char c, struct Enigma *machine){
+
+    c = toupper(c);
+
+    // Plugboard
+    int req_index = str_index(alpha, c);
+
+    // Cycle first rotor before pushing through,
+    rotor_cycle(&machine->rotors[0]);
+
+    // Double step the rotor
+    if(machine->numrotors > 1 && str_index(machine->rotors[1].notch,
+                alpha[machine->rotors[1].offset]) >= 0 ) {
+        rotor_cycle(&machine->rotors[1]);
+    }
+
+    // Stepping the rotors
+    for(int i = 0; i < machine->numrotors - 1; i++) {
+        c = alpha[machine->rotors[i].offset];
+
+        if(machine->rotors[i].turnnext) {
+            machine->rotors[i].turnnext = 0;
+            rotor_cycle(&machine->rotors[i+1]);
+        }
+    }
+
+    // Pass through all the rotors forward
+    for(int i = 0; i < machine->numrotors; i++) {
+        req_index = rotor_forward(&machine->rotors[i], req_index);
+    }
+
+    // Pass through the reflector
+    // Inbound
+    c = machine->reflector[req_index];
+    // Outbound
+    req_index = str_index(alpha, c);
+
+    // Pass back through the rotors in reverse
+    for(int i = machine->numrotors - 1; i >= 0; i--) {
+        req_index = rotor_reverse(&machine->rotors[i], req_index);
+    }
+
+    // Pass through Plugboard
+    c = alpha[req_index];
+
+    return c;
+}
+
+/*
+ * Encrypt a message in place, letters only; everything else passes through.
+ */
+void enigma_encrypt(struct Enigma *machine, char *buf, int len) {
+    TRACE_POINT(TRACE_ENCRYPT_BEGIN, -1, len);
+
+    for (int i = 0; i < len; i++) {
+        if (isalpha((unsigned char)buf[i]))
+            buf[i] = encryptChar(buf[i], machine);
+    }
+
+    TRACE_POINT(TRACE_ENCRYPT_END, -1, len);
+}
+
+static struct ByteWheel byte_wheels[8];
+static uint8_t byte_reflector[BYTES];
+static pthread_once_t byte_once = PTHREAD_ONCE_INIT;
+
+/*
+ * xorshift32, only used to derive the fixed wirings.
+ */
+static uint32_t byte_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void byte_shuffle(uint8_t *p, uint32_t *state) {
+    for (int i = 0; i < BYTES; i++) p[i] = i;
+    for (int i = BYTES - 1; i > 0; i--) {
+        int j = byte_random(state) % (i + 1);
+        uint8_t t = p[i];
+        p[i] = p[j];
+        p[j] = t;
+    }
+}
+
+/*
+ * Generate the eight byte wheels and the reflector.
+ * Fixed seed, so every build and every peer gets the same machine.
+ */
+static void byte_tables_init(void) {
+    uint32_t state = 0x454e4947;
+    uint8_t order[BYTES];
+
+    for (int w = 0; w < 8; w++) {
+        struct ByteWheel *wheel = &byte_wheels[w];
+
+        byte_shuffle(wheel->forward, &state);
+        for (int i = 0; i < BYTES; i++) wheel->reverse[wheel->forward[i]] = i;
+
+        // Same turnover points as the letter rotor, scaled to 256 positions
+        for (const char *t = rotor_turnovers[w]; *t; t++) {
+            int pos = str_index(alpha, *t) * BYTES / ROTATE;
+            wheel->turnover[pos] = 1;
+            wheel->notch[(pos + BYTES - 1) % BYTES] = 1;
+        }
+
+        for (int pos = 0; pos < BYTES; pos++) {
+            int k = 0;
+            while (k < BYTES - 1 && !wheel->turnover[(pos + k + 1) % BYTES]) k++;
+            wheel->run[pos] = k;
+        }
+    }
+
+    // Pairing up a shuffled order gives an involution without fixed points, like the letter reflectors
+    byte_shuffle(order, &state);
+    for (int i = 0; i < BYTES; i += 2) {
+        byte_reflector[order[i]] = order[i + 1];
+        byte_reflector[order[i + 1]] = order[i];
+    }
+}
+
+/*
+ * Configure a byte machine, rotors as for letters, offsets two hex digits per rotor, e.g. "00FF10".
+ * Either may be NULL to take the default "321" / all zero.
+ * returns 0 on success, -1 if the key is malformed.
+ */
+int byte_enigma_parse_key(struct ByteEnigma *machine, const char *rotors, const char *offsets) {
+    pthread_once(&byte_once, byte_tables_init);
+
+    if (!rotors) rotors = "321";
+
+    int n = strlen(rotors);
+    if (n < 1 || n > 8 || (offsets && strlen(offsets) != 2 * n)) return -1;
+
+    memset(machine, 0, sizeof *machine);
+    machine->reflector = byte_reflector;
+
+    for (int i = 0; i < n; i++) {
+        if (rotors[i] < '1' || rotors[i] > '8') return -1;
+
+        int offset = 0;
+        if (offsets) {
+            char hex[3] = { offsets[2 * i], offsets[2 * i + 1], '\0' };
+            if (!isxdigit((unsigned char)hex[0]) || !isxdigit((unsigned char)hex[1])) return -1;
+            offset = strtol(hex, NULL, 16);
+        }
+
+        machine->rotors[i].offset = offset;
+        machine->rotors[i].wheel = &byte_wheels[rotors[i] - '1'];
+        machine->numrotors++;
+    }
+
+    return 0;
+}
+
+static void byte_rotor_cycle(struct ByteRotor *rotor) {
+    rotor->offset = (rotor->offset + 1) % BYTES;
+
+    if (rotor->wheel->turnover[rotor->offset]) rotor->turnnext = 1;
+}
+
+static inline uint8_t byte_forward(const struct ByteRotor *rotor, uint8_t c) {
+    return rotor->wheel->forward[(uint8_t)(c + rotor->offset)] - rotor->offset;
+}
+
+static inline uint8_t byte_reverse(const struct ByteRotor *rotor, uint8_t c) {
+    return rotor->wheel->reverse[(uint8_t)(c + rotor->offset)] - rotor->offset;
+}
+
+/*
+ * Step the rotors exactly like encryptChar does.
+ */
+static void byte_step(struct ByteEnigma *machine) {
+    byte_rotor_cycle(&machine->rotors[0]);
+
+    // Double step the rotor
+    if (machine->numrotors > 1 && machine->rotors[1].wheel->notch[machine->rotors[1].offset]) {
+        byte_rotor_cycle(&machine->rotors[1]);
+        machine->middle_valid = 0;
+    }
+
+    for (int i = 0; i < machine->numrotors - 1; i++) {
+        if (machine->rotors[i].turnnext) {
+            machine->rotors[i].turnnext = 0;
+            byte_rotor_cycle(&machine->rotors[i+1]);
+            machine->middle_valid = 0;
+        }
+    }
+}
+
+/*
+ * Compose everything behind the first rotor into one table.
+ */
+static void byte_middle(struct ByteEnigma *machine) {
+    for (int c = 0; c < BYTES; c++) {
+        uint8_t x = c;
+
+        for (int i = 1; i < machine->numrotors; i++) x = byte_forward(&machine->rotors[i], x);
+        x = machine->reflector[x];
+        for (int i = machine->numrotors - 1; i >= 1; i--) x = byte_reverse(&machine->rotors[i], x);
+
+        machine->middle[c] = x;
+    }
+
+    machine->middle_valid = 1;
+}
+
+/*
+ * Push a single byte through the machine, the reference for byte_enigma_encrypt.
+ */
+uint8_t encryptByte(uint8_t c, struct ByteEnigma *machine) {
+    byte_step(machine);
+
+    for (int i = 0; i < machine->numrotors; i++) c = byte_forward(&machine->rotors[i], c);
+    c = machine->reflector[c];
+    for (int i = machine->numrotors - 1; i >= 0; i--) c = byte_reverse(&machine->rotors[i], c);
+
+    return c;
+}
+
+/*
+ * Encrypt binary data in place.
+ * Between turnovers only the first rotor moves, so each run of bytes goes
+ * through three table lookups per byte with no branches: the first rotor
+ * in, the cached composition of the rest, the first rotor out.
+ */
+void byte_enigma_encrypt(struct ByteEnigma *machine, uint8_t *buf, int len) {
+    struct ByteRotor *first = &machine->rotors[0];
+    const uint8_t *forward = first->wheel->forward;
+    const uint8_t *reverse = first->wheel->reverse;
+    int i = 0;
+
+    TRACE_POINT(TRACE_ENCRYPT_BEGIN, -1, len);
+
+    while (i < len) {
+        int run = first->wheel->run[first->offset];
+        if (machine->numrotors > 1 && machine->rotors[1].wheel->notch[machine->rotors[1].offset]) run = 0;
+        if (run > len - i) run = len - i;
+
+        // Rebuilding the composition only pays off for longer runs
+        if (run == 0 || (!machine->middle_valid && run < 32)) {
+            buf[i] = encryptByte(buf[i], machine);
+            i++;
+            continue;
+        }
+
+        if (!machine->middle_valid) byte_middle(machine);
+
+        const uint8_t *middle = machine->middle;
+        uint8_t offset = first->offset + 1;
+        uint8_t *p = buf + i;
+
+        for (int k = 0; k < run; k++, offset++) {
+            uint8_t x = forward[(uint8_t)(p[k] + offset)] - offset;
+            x = middle[x];
+            p[k] = reverse[(uint8_t)(x + offset)] - offset;
+        }
+
+        first->offset = (first->offset + run) % BYTES;
+        i += run;
+    }
+
+    TRACE_POINT(TRACE_ENCRYPT_END, -1, len);
+}
+
+/*
+ * Configure either machine from a key, a rotor order starting with 'b' selects bytes.
+ * returns 0 on success, -1 if the key is malformed.
+ */
+int machine_parse_key(struct Machine *machine, const char *rotors, const char *offsets) {
+    if (rotors && (rotors[0] == 'b' || rotors[0] == 'B')) {
+        machine->type = MACHINE_BYTES;
+        return byte_enigma_parse_key(&machine->bytes, rotors[1] ? rotors + 1 : NULL, offsets);
+    }
+
+    machine->type = MACHINE_LETTERS;
+    return enigma_parse_key(&machine->letters, rotors, offsets);
+}
+
+void machine_encrypt(struct Machine *machine, char *buf, int len) {
+    if (machine->type == MACHINE_BYTES)
+        byte_enigma_encrypt(&machine->bytes, (uint8_t *)buf, len);
+    else
+        enigma_encrypt(&machine->letters, buf, len);
+}
+
 /*
  * Run the enigma machine
  * /
@@ -2,6 +2,7 @@
 #define ENIGMA_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 extern const char *alpha;
 
@@ -26,9 +27,62 @@ struct Enigma {
     struct Rotor    rotors[8];
 };
 
+/*
+ * Byte-alphabet machine: the same rotor / reflector construction over all
+ * 256 byte values, so binary payloads need no encoding. Wirings are
+ * generated once from fixed seeds, turnovers mirror the letter rotors.
+ */
+struct ByteWheel {
+    uint8_t         forward[256];
+    uint8_t         reverse[256];       // inverse of forward
+    uint8_t         turnover[256];      // 1 where the next rotor turns
+    uint8_t         notch[256];         // 1 one position before a turnover, for the double step
+    uint8_t         run[256];           // steps from a position before landing on a turnover
+};
+
+struct ByteRotor {
+    int                     offset;
+    int                     turnnext;
+    const struct ByteWheel  *wheel;
+};
+
+struct ByteEnigma {
+    int                 numrotors;
+    const uint8_t       *reflector;
+    struct ByteRotor    rotors[8];
+    int                 middle_valid;
+    uint8_t             middle[256];    // rotors 1.. and reflector composed, valid until one of them steps
+};
+
+/*
+ * Either machine, chosen by the key: "321 AAA" for letters,
+ * "b321 00FF10" (hex offsets) for bytes.
+ */
+enum { MACHINE_LETTERS, MACHINE_BYTES };
+
+struct Machine {
+    int                     type;
+    union {
+        struct Enigma       letters;
+        struct ByteEnigma   bytes;
+    };
+};
+
 extern int str_index(const char *, int);
 extern void rotor_cycle(struct Rotor *);
 extern int rotor_forward(struct Rotor *, int);
 extern int rotor_reverse(struct Rotor *, int);
 
+extern struct Rotor new_rotor(struct Enigma *, int, int);
+extern int enigma_parse_key(struct Enigma *, const char *, const char *);
+extern char encryptChar(char, struct Enigma *);
+extern void enigma_encrypt(struct Enigma *, char *, int);
+
+extern int byte_enigma_parse_key(struct ByteEnigma *, const char *, const char *);
+extern uint8_t encryptByte(uint8_t, struct ByteEnigma *);
+extern void byte_enigma_encrypt(struct ByteEnigma *, uint8_t *, int);
+
+extern int machine_parse_key(struct Machine *, const char *, const char *);
+extern void machine_encrypt(struct Machine *, char *, int);
+
 #endif
\ No newline at end of file
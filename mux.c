@@ -0,0 +1,432 @@
+/*
+** mux.c -- logical channels multiplexed over one connection
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "mux.h"
+#include "outq.h"
+
+/*** Frames ***/
+
+/*
+ * Allocate a frame with its header filled in and room for len bytes of payload.
+ */
+static struct msgbuf *frame_new(uint32_t stream, int type, int len) {
+    struct msgbuf *buf = msgbuf_new(NULL, MUX_HEADER + len);
+    if (!buf) return NULL;
+
+    uint32_t id = htonl(stream);
+    uint16_t length = htons(len);
+    memcpy(buf->data, &id, 4);
+    buf->data[4] = type;
+    buf->data[5] = 0;
+    memcpy(buf->data + 6, &length, 2);
+
+    return buf;
+}
+
+/*
+ * Send a small frame that is not subject to flow control.
+ */
+static int send_control(struct connection *conn, uint32_t stream, int type, const void *payload, int len) {
+    struct msgbuf *buf = frame_new(stream, type, len);
+    if (!buf) return -1;
+
+    if (len) memcpy(buf->data + MUX_HEADER, payload, len);
+    int status = conn_send_buf(conn, buf);
+    msgbuf_unref(buf);
+
+    return status;
+}
+
+static int send_window(struct connection *conn, uint32_t stream, uint32_t increment) {
+    increment = htonl(increment);
+    return send_control(conn, stream, MUX_WINDOW_UPDATE, &increment, 4);
+}
+
+/*** Channels ***/
+
+static uint32_t hash(uint32_t id) {
+    return id * 2654435761u;
+}
+
+static struct mux_channel *channel_find(struct mux *mux, uint32_t id) {
+    struct mux_channel *ch = mux->buckets[hash(id) & (mux->nbuckets - 1)];
+
+    while (ch && ch->id != id) ch = ch->next;
+
+    return ch;
+}
+
+/*
+ * Double the bucket array once the chains average one channel.
+ */
+static void channel_rehash(struct mux *mux) {
+    uint32_t nbuckets = mux->nbuckets * 2;
+    struct mux_channel **buckets = calloc(nbuckets, sizeof *buckets);
+    if (!buckets) return;
+
+    for (uint32_t i = 0; i < mux->nbuckets; i++) {
+        struct mux_channel *ch = mux->buckets[i], *next;
+        for (; ch; ch = next) {
+            next = ch->next;
+            ch->next = buckets[hash(ch->id) & (nbuckets - 1)];
+            buckets[hash(ch->id) & (nbuckets - 1)] = ch;
+        }
+    }
+
+    free(mux->buckets);
+    mux->buckets = buckets;
+    mux->nbuckets = nbuckets;
+}
+
+/*
+ * Memory a held reply of len bytes takes, bookkeeping included.
+ */
+static size_t held_size(int len) {
+    return sizeof(struct msgbuf) + len + sizeof(struct mux_pending);
+}
+
+static void channel_block(struct mux *mux, struct mux_channel *ch) {
+    if (ch->blocked) return;
+
+    ch->blocked = 1;
+    ch->blocked_prev = NULL;
+    ch->blocked_next = mux->blocked;
+    if (mux->blocked) mux->blocked->blocked_prev = ch;
+    mux->blocked = ch;
+}
+
+static void channel_unblock(struct mux *mux, struct mux_channel *ch) {
+    if (!ch->blocked) return;
+
+    ch->blocked = 0;
+    if (ch->blocked_prev) ch->blocked_prev->blocked_next = ch->blocked_next;
+    else mux->blocked = ch->blocked_next;
+    if (ch->blocked_next) ch->blocked_next->blocked_prev = ch->blocked_prev;
+}
+
+/*
+ * Unlink and free a channel along with the replies it still holds.
+ */
+static void channel_remove(struct mux *mux, struct mux_channel *ch) {
+    struct mux_channel **p = &mux->buckets[hash(ch->id) & (mux->nbuckets - 1)];
+
+    while (*p != ch) p = &(*p)->next;
+    *p = ch->next;
+
+    channel_unblock(mux, ch);
+
+    while (ch->pending_head) {
+        struct mux_pending *pending = ch->pending_head;
+        ch->pending_head = pending->next;
+        mux->held -= held_size(pending->buf->len);
+        msgbuf_unref(pending->buf);
+        free(pending);
+    }
+
+    mux->nchannels--;
+    free(ch);
+}
+
+/*
+ * Return credit to the client once half a window was used,
+ * unless replies are already piling up on this channel or the connection,
+ * or the queue has no room for the WINDOW frame.
+ */
+static int channel_grant(struct connection *conn, struct mux_channel *ch) {
+    if (ch->consumed < MUX_WINDOW / 2 || ch->pending_bytes >= MUX_WINDOW) return 0;
+    if (conn->mux->held >= conn->outq.limit) {
+        conn->mux->starved = 1;
+        return 0;
+    }
+    if (!outq_room(&conn->outq, MUX_CONTROL_MAX)) {
+        conn->mux->deferred = 1;
+        return 0;
+    }
+
+    ch->recv_credit += ch->consumed;
+    int status = send_window(conn, ch->id, ch->consumed);
+    ch->consumed = 0;
+
+    return status;
+}
+
+/*
+ * Whether a reply of len bytes has to wait instead of going out now.
+ */
+static int channel_must_hold(struct connection *conn, struct mux_channel *ch, int len) {
+    return ch->pending_head || len - MUX_HEADER > ch->send_credit || !outq_room(&conn->outq, len);
+}
+
+/*
+ * Send a reply on a channel, or hold it until the client gives credit
+ * and the connection queue has room.
+ */
+static int channel_send(struct connection *conn, struct mux_channel *ch, struct msgbuf *buf) {
+    int payload = buf->len - MUX_HEADER;
+
+    if (!channel_must_hold(conn, ch, buf->len)) {
+        ch->send_credit -= payload;
+        return conn_send_buf(conn, buf);
+    }
+
+    struct mux_pending *pending = malloc(sizeof *pending);
+    if (!pending) return -1;
+
+    msgbuf_ref(buf);
+    pending->buf = buf;
+    pending->next = NULL;
+    if (ch->pending_tail) ch->pending_tail->next = pending;
+    else ch->pending_head = pending;
+    ch->pending_tail = pending;
+    ch->pending_bytes += payload;
+    conn->mux->held += held_size(buf->len);
+    channel_block(conn->mux, ch);
+
+    return 0;
+}
+
+/*** Protocol ***/
+
+/*
+ * Close a stream from our side, telling the client why.
+ */
+static int channel_reset(struct connection *conn, uint32_t stream, const char *reason) {
+    struct mux_channel *ch = channel_find(conn->mux, stream);
+    if (ch) channel_remove(conn->mux, ch);
+
+    return send_control(conn, stream, MUX_CLOSE, reason, strlen(reason));
+}
+
+static int handle_open(struct connection *conn, uint32_t stream, const char *payload, int len) {
+    struct mux *mux = conn->mux;
+    char key[MUX_MAX_PAYLOAD + 1];
+    char *save;
+    struct Machine machine;
+
+    if (channel_find(mux, stream)) return channel_reset(conn, stream, "stream already open");
+    // Streams cost memory of their own, they share the connection's queue limit too
+    if (mux->nchannels == MUX_MAX_CHANNELS || (mux->nchannels + 1) * sizeof(struct mux_channel) > conn->outq.limit)
+        return channel_reset(conn, stream, "too many streams");
+
+    memcpy(key, payload, len);
+    key[len] = '\0';
+    char *rotors = strtok_r(key, " ", &save);
+    char *offsets = strtok_r(NULL, " ", &save);
+    if (machine_parse_key(&machine, rotors, offsets) == -1) return channel_reset(conn, stream, "bad key");
+
+    struct mux_channel *ch = calloc(1, sizeof *ch);
+    if (!ch) return channel_reset(conn, stream, "out of memory");
+
+    ch->id = stream;
+    ch->machine = machine;
+    ch->send_credit = MUX_WINDOW;
+    ch->recv_credit = MUX_WINDOW;
+
+    uint32_t b = hash(stream) & (mux->nbuckets - 1);
+    ch->next = mux->buckets[b];
+    mux->buckets[b] = ch;
+    if (++mux->nchannels > mux->nbuckets) channel_rehash(mux);
+
+    return 0;
+}
+
+static int handle_data(struct connection *conn, uint32_t stream, const char *payload, int len) {
+    struct mux_channel *ch = channel_find(conn->mux, stream);
+
+    if (!ch) return send_control(conn, stream, MUX_CLOSE, "unknown stream", strlen("unknown stream"));
+    if (len > ch->recv_credit) return channel_reset(conn, stream, "flow control violation");
+
+    // The client may hold credit on many streams at once, the connection still has one budget
+    if (channel_must_hold(conn, ch, MUX_HEADER + len) &&
+        conn->mux->held + held_size(MUX_HEADER + len) > conn->outq.limit)
+        return channel_reset(conn, stream, "connection over budget");
+
+    ch->recv_credit -= len;
+    ch->consumed += len;
+
+    // Encrypted straight into the reply frame
+    struct msgbuf *reply = frame_new(stream, MUX_DATA, len);
+    if (!reply) return -1;
+    memcpy(reply->data + MUX_HEADER, payload, len);
+    machine_encrypt(&ch->machine, reply->data + MUX_HEADER, len);
+
+    int status = channel_send(conn, ch, reply);
+    msgbuf_unref(reply);
+    if (status == -1) return -1;
+
+    return channel_grant(conn, ch);
+}
+
+static int handle_window(struct connection *conn, uint32_t stream, const char *payload, int len) {
+    struct mux_channel *ch = channel_find(conn->mux, stream);
+    uint32_t increment;
+
+    if (!ch || len != 4) return 0;
+
+    memcpy(&increment, payload, 4);
+    ch->send_credit += ntohl(increment);
+    if (ch->send_credit > INT32_MAX) return channel_reset(conn, stream, "window overflow");
+
+    // Held replies go out from mux_flush
+    return 0;
+}
+
+static int handle_frame(struct connection *conn, uint32_t stream, int type, const char *payload, int len) {
+    struct mux_channel *ch;
+
+    // Stream 0 is the connection itself, PING needs no answer
+    if (stream == 0) return 0;
+
+    switch (type) {
+    case MUX_OPEN:
+        return handle_open(conn, stream, payload, len);
+    case MUX_DATA:
+        return handle_data(conn, stream, payload, len);
+    case MUX_CLOSE:
+        if ((ch = channel_find(conn->mux, stream)) != NULL) channel_remove(conn->mux, ch);
+        return 0;
+    case MUX_WINDOW_UPDATE:
+        return handle_window(conn, stream, payload, len);
+    default:
+        return 0;
+    }
+}
+
+/*** Connection ***/
+
+struct mux *mux_new(void) {
+    struct mux *mux = calloc(1, sizeof *mux);
+    if (!mux) return NULL;
+
+    mux->nbuckets = 64;
+    if ((mux->buckets = calloc(mux->nbuckets, sizeof *mux->buckets)) == NULL) {
+        free(mux);
+        return NULL;
+    }
+
+    return mux;
+}
+
+void mux_free(struct mux *mux) {
+    if (!mux) return;
+
+    for (uint32_t i = 0; i < mux->nbuckets; i++) {
+        while (mux->buckets[i]) channel_remove(mux, mux->buckets[i]);
+    }
+
+    free(mux->buckets);
+    free(mux);
+}
+
+/*
+ * Acknowledge "/mux", announcing the initial per-stream window.
+ */
+int mux_hello(struct connection *conn) {
+    uint32_t window = htonl(MUX_WINDOW);
+    return send_control(conn, 0, MUX_OPEN, &window, 4);
+}
+
+/*
+ * Feed received bytes in, frames may be split across calls.
+ * Parsing stops while the queue could not take a control frame, call again
+ * with no data once it drained. Only feed data while not stalled, at most
+ * MUX_HEADER + MUX_MAX_PAYLOAD bytes at a time.
+ * returns 0 on success, -1 if the connection has to be closed.
+ */
+int mux_input(struct connection *conn, const char *data, int len) {
+    struct mux *mux = conn->mux;
+
+    if (len > (int)sizeof mux->in - mux->inlen) return -1;
+    if (len) memcpy(mux->in + mux->inlen, data, len);
+    mux->inlen += len;
+    mux->stalled = 0;
+
+    int off = 0;
+    while (mux->inlen - off >= MUX_HEADER) {
+        uint32_t stream;
+        uint16_t length;
+        memcpy(&stream, mux->in + off, 4);
+        memcpy(&length, mux->in + off + 6, 2);
+        stream = ntohl(stream);
+        length = ntohs(length);
+
+        if (length > MUX_MAX_PAYLOAD) return -1;
+        if (mux->inlen - off < MUX_HEADER + length) break;
+
+        if (!outq_room(&conn->outq, MUX_CONTROL_MAX)) {
+            mux->stalled = 1;
+            break;
+        }
+
+        if (handle_frame(conn, stream, (unsigned char)mux->in[off + 4], mux->in + off + MUX_HEADER, length) == -1)
+            return -1;
+        off += MUX_HEADER + length;
+    }
+
+    memmove(mux->in, mux->in + off, mux->inlen - off);
+    mux->inlen -= off;
+
+    return 0;
+}
+
+/*
+ * Send held replies for which the client has given credit, as far as the connection queue allows.
+ * returns 0 on success, -1 if the connection has to be closed.
+ */
+int mux_flush(struct connection *conn) {
+    struct mux *mux = conn->mux;
+    struct mux_channel *ch, *next;
+
+    for (ch = mux->blocked; ch; ch = next) {
+        next = ch->blocked_next;
+
+        while (ch->pending_head) {
+            struct mux_pending *pending = ch->pending_head;
+            int payload = pending->buf->len - MUX_HEADER;
+
+            if (payload > ch->send_credit || !outq_room(&conn->outq, pending->buf->len)) break;
+
+            ch->send_credit -= payload;
+            ch->pending_bytes -= payload;
+            ch->pending_head = pending->next;
+            if (!ch->pending_head) ch->pending_tail = NULL;
+            mux->held -= held_size(pending->buf->len);
+
+            int status = conn_send_buf(conn, pending->buf);
+            msgbuf_unref(pending->buf);
+            free(pending);
+            if (status == -1) return -1;
+        }
+
+        if (ch->pending_head) continue;
+
+        channel_unblock(mux, ch);
+        if (channel_grant(conn, ch) == -1) return -1;
+    }
+
+    // Back under half the budget, or the queue took frames again, hand out the credit that was withheld
+    if ((mux->starved && mux->held < conn->outq.limit / 2) ||
+        (mux->deferred && outq_room(&conn->outq, MUX_CONTROL_MAX))) {
+        mux->starved = 0;
+        mux->deferred = 0;
+        for (uint32_t i = 0; i < mux->nbuckets; i++) {
+            for (ch = mux->buckets[i]; ch; ch = ch->next) {
+                if (channel_grant(conn, ch) == -1) return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Connection keepalive, one per physical connection however many streams it carries.
+ */
+int mux_ping(struct connection *conn) {
+    return send_control(conn, 0, MUX_PING, NULL, 0);
+}
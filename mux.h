@@ -0,0 +1,89 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include <stdint.h>
+
+#include "enigma.h"
+#include "server.h"
+
+/*
+ * Logical channels over one connection, switched on with "/mux".
+ * The server answers with an OPEN frame on stream 0 carrying the initial
+ * window, from then on both directions only carry frames. Frames may
+ * follow the command without waiting for that answer if the command ends
+ * with a line break or the first stream id is below 2^24:
+ *
+ *   uint32 stream | uint8 type | uint8 flags | uint16 length | payload
+ *
+ * in network byte order. Stream 0 belongs to the connection itself.
+ *
+ *   OPEN    client opens a stream, payload is an optional key "321 AAA",
+ *           or "b321 00FF10" for the byte machine, which takes any binary DATA
+ *   DATA    plaintext from the client, ciphertext from the server
+ *   CLOSE   either side ends the stream, payload is an optional reason
+ *   WINDOW  payload is a uint32 credit increment for the peer
+ *   PING    keepalive on stream 0, ignored by the server
+ *
+ * Each stream starts with MUX_WINDOW bytes of credit in both directions.
+ * The server returns credit as it processes DATA, but withholds it while
+ * replies are stuck waiting for the client's credit, so one slow stream
+ * only ever stops itself.
+ * Held replies of all streams together, bookkeeping included, count
+ * against the connection's queue limit: past it no stream gets credit
+ * back, and DATA whose reply would have to be held on top closes its
+ * stream. The streams themselves may take up to the queue limit as well,
+ * so a connection holds at most about twice the limit.
+ * Any frame may be answered with a control frame, so frames are only
+ * parsed while the queue can take one; the rest waits in the input buffer
+ * and the connection stops reading until the queue drains.
+ */
+
+#define MUX_HEADER 8
+#define MUX_MAX_PAYLOAD 2048
+#define MUX_WINDOW (16 * 1024)
+#define MUX_MAX_CHANNELS 65536
+#define MUX_CONTROL_MAX (MUX_HEADER + 32)   // largest control frame the server sends
+
+enum { MUX_OPEN, MUX_DATA, MUX_CLOSE, MUX_WINDOW_UPDATE, MUX_PING };
+
+struct mux_pending {
+    struct msgbuf           *buf;
+    struct mux_pending      *next;
+};
+
+struct mux_channel {
+    uint32_t                id;
+    struct Machine          machine;
+    int64_t                 send_credit;    // bytes we may still send
+    int32_t                 recv_credit;    // bytes the client may still send
+    int32_t                 consumed;       // received since the last WINDOW we sent
+    int32_t                 pending_bytes;
+    struct mux_pending      *pending_head;
+    struct mux_pending      *pending_tail;
+    struct mux_channel      *next;          // hash chain
+    struct mux_channel      *blocked_next;  // channels with pending replies
+    struct mux_channel      *blocked_prev;
+    int                     blocked;
+};
+
+struct mux {
+    struct mux_channel      **buckets;
+    uint32_t                nbuckets;       // power of two
+    uint32_t                nchannels;
+    struct mux_channel      *blocked;
+    size_t                  held;           // memory of replies held across all channels
+    int                     starved;        // credit was withheld because held hit the budget
+    int                     deferred;       // credit was withheld because the queue was full
+    int                     stalled;        // complete frames wait in in for queue room
+    int                     inlen;
+    char                    in[2 * (MUX_HEADER + MUX_MAX_PAYLOAD)];     // a partial frame and one read
+};
+
+extern struct mux *mux_new(void);
+extern void mux_free(struct mux *);
+extern int mux_hello(struct connection *);
+extern int mux_input(struct connection *, const char *, int);
+extern int mux_flush(struct connection *);
+extern int mux_ping(struct connection *);
+
+#endif
@@ -0,0 +1,158 @@
+/*
+** outq.c -- refcounted message buffers and bounded per-connection queues
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "outq.h"
+
+/*
+ * Allocate a message holding a copy of data, with one reference.
+ */
+struct msgbuf *msgbuf_new(const char *data, int len) {
+    struct msgbuf *buf = malloc(sizeof *buf + len);
+    if (!buf) return NULL;
+
+    buf->refs = 1;
+    buf->len = len;
+    if (data) memcpy(buf->data, data, len);
+
+    return buf;
+}
+
+void msgbuf_ref(struct msgbuf *buf) {
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+void msgbuf_unref(struct msgbuf *buf) {
+    if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(buf);
+}
+
+/*
+ * Setup an empty queue capped at limit bytes, overflowing according to policy.
+ * returns 0 on success, -1 if the eventfd could not be created.
+ */
+int outq_init(struct outq *q, size_t limit, int policy) {
+    memset(q, 0, sizeof *q);
+    q->limit = limit;
+    q->policy = policy;
+    q->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->wakefd == -1) return -1;
+
+    pthread_mutex_init(&q->lock, NULL);
+
+    return 0;
+}
+
+/*
+ * Drop every pending message and release the eventfd.
+ */
+void outq_destroy(struct outq *q) {
+    for (int i = 0; i < q->count; i++)
+        msgbuf_unref(q->slots[(q->head + i) % OUTQ_SLOTS]);
+
+    pthread_mutex_destroy(&q->lock);
+    close(q->wakefd);
+}
+
+/*
+ * Queue a reference to buf, never blocks.
+ * Producers other than the owner pass wake so the owner notices the new message.
+ * returns 0 if queued, -1 if the queue is full and the message was dropped.
+ */
+int outq_push(struct outq *q, struct msgbuf *buf, int wake) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count == OUTQ_SLOTS || q->bytes + buf->len > q->limit) {
+        q->dropped++;
+        if (q->policy == OUTQ_DROP && !q->overflowed) {
+            q->overflowed = 1;
+            write(q->wakefd, &one, sizeof one);
+        }
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+
+    msgbuf_ref(buf);
+    q->slots[(q->head + q->count) % OUTQ_SLOTS] = buf;
+    // Only the empty -> non-empty transition needs a wakeup
+    wake = wake && q->count == 0;
+    q->count++;
+    q->bytes += buf->len;
+    pthread_mutex_unlock(&q->lock);
+
+    if (wake) write(q->wakefd, &one, sizeof one);
+
+    return 0;
+}
+
+/*
+ * Look at the oldest message without removing it, owner only.
+ * offset receives how much of it was already written.
+ * returns NULL if the queue is empty.
+ */
+struct msgbuf *outq_peek(struct outq *q, int *offset) {
+    struct msgbuf *buf = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        buf = q->slots[q->head];
+        *offset = q->offset;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return buf;
+}
+
+/*
+ * Account for n more bytes of the oldest message written, owner only.
+ * The message is released once it has been written completely.
+ */
+void outq_advance(struct outq *q, int n) {
+    struct msgbuf *done = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    q->offset += n;
+    q->bytes -= n;
+    if (q->offset == q->slots[q->head]->len) {
+        done = q->slots[q->head];
+        q->head = (q->head + 1) % OUTQ_SLOTS;
+        q->count--;
+        q->offset = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (done) msgbuf_unref(done);
+}
+
+/*
+ * returns the number of messages waiting.
+ */
+int outq_pending(struct outq *q) {
+    int count;
+
+    pthread_mutex_lock(&q->lock);
+    count = q->count;
+    pthread_mutex_unlock(&q->lock);
+
+    return count;
+}
+
+/*
+ * returns 1 if a len byte message would fit right now, 0 otherwise.
+ */
+int outq_room(struct outq *q, int len) {
+    int room;
+
+    pthread_mutex_lock(&q->lock);
+    room = q->count < OUTQ_SLOTS && q->bytes + len <= q->limit;
+    pthread_mutex_unlock(&q->lock);
+
+    return room;
+}
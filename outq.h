@@ -0,0 +1,59 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define OUTQ_SLOTS 256
+#define OUTQ_LIMIT (1 << 20)    // default byte cap of a connection's outbound queue
+
+/*
+ * What happens when a queue hits its byte cap.
+ * OUTQ_PAUSE: the owner stops reading until it drains, fan-out messages are dropped for it.
+ * OUTQ_DROP: the connection is closed.
+ */
+enum { OUTQ_PAUSE, OUTQ_DROP };
+
+/*
+ * A message shared between every connection that has to send it.
+ * Fan-out only takes references, the payload is never copied.
+ */
+struct msgbuf {
+    int             refs;
+    int             len;
+    char            data[];
+};
+
+/*
+ * Bounded ring of pending messages for one connection.
+ * Producers are other connection threads, the consumer is the owner.
+ * wakefd is an eventfd that is signalled when the queue becomes non-empty,
+ * or when it overflowed under OUTQ_DROP.
+ */
+struct outq {
+    pthread_mutex_t lock;
+    struct msgbuf   *slots[OUTQ_SLOTS];
+    int             head;
+    int             count;
+    int             offset;     // bytes of the head message already written
+    size_t          bytes;
+    size_t          limit;
+    int             policy;
+    int             overflowed;
+    int             wakefd;
+    unsigned long   dropped;
+};
+
+extern struct msgbuf *msgbuf_new(const char *, int);
+extern void msgbuf_ref(struct msgbuf *);
+extern void msgbuf_unref(struct msgbuf *);
+
+extern int outq_init(struct outq *, size_t, int);
+extern void outq_destroy(struct outq *);
+extern int outq_push(struct outq *, struct msgbuf *, int);
+extern struct msgbuf *outq_peek(struct outq *, int *);
+extern void outq_advance(struct outq *, int);
+extern int outq_pending(struct outq *);
+extern int outq_room(struct outq *, int);
+
+#endif
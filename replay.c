@@ -0,0 +1,489 @@
+/*
+** replay.c -- drive a server from a capture file and report reply latency
+*/
+
+/*** Libraries ***/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+/*** Headers ***/
+#include "capture.h"
+#include "mux.h"
+
+/*** Defines ***/
+#define BUFFER 2048
+#define check(expr) if (!(expr)) { perror(#expr); kill(0, SIGTERM); }
+#define USAGE "program usage: ./replay capture_file port|-u unix_socket_path [-x speed | -f]"
+#define WAIT_NS 2000000000ull       // how long to wait for outstanding replies
+#define SERVICE_EVERY 32            // events between socket checks when replaying as fast as possible
+
+/*** Data ***/
+struct event {
+    uint64_t        ts;
+    uint32_t        conn;
+    uint32_t        len;
+    uint8_t         type;
+    char            *payload;       // NULL in a capture without payloads
+    uint64_t        target;         // IN: reply bytes received once this message is answered
+    uint64_t        before;         // IN: reply bytes expected before it was sent
+};
+
+struct pending_reply {
+    uint64_t        sent;
+    uint64_t        target;
+};
+
+struct replay_conn {
+    int             fd;             // -1 unless open
+    int             opened;
+    int             closing;
+    uint64_t        deadline;
+    int             mux;            // switched to frames, PING frames are not part of the reply stream
+    int             hello;          // waiting for the mux acknowledgement
+    char            *expected;      // the captured replies, NULL without payloads
+    uint64_t        expected_len;
+    uint64_t        received;
+    int             mismatched;
+    uint64_t        mismatch_at;
+    char            *out;           // bytes the socket did not take yet
+    size_t          outlen;
+    struct pending_reply *pending;
+    int             npending;
+    int             head;
+    int             cap;
+    unsigned char   hdr[MUX_HEADER];
+    int             hdrlen;
+    uint32_t        frame_left;
+};
+
+struct event *events = NULL;
+size_t nevents = 0;
+struct replay_conn *conns = NULL;
+uint32_t nconns = 0;
+int payloads;
+
+uint64_t *latencies = NULL;
+size_t nlatencies = 0, latencies_cap = 0;
+uint64_t bytes_sent = 0, messages_sent = 0;
+
+char *unix_path = NULL;
+char *port = NULL;
+
+/*** Declarations ***/
+void load_capture(const char *path);
+void open_conn(struct replay_conn *c);
+void send_message(struct replay_conn *c, struct event *e, uint64_t now);
+void service(int timeout_ms);
+void feed(struct replay_conn *c, const unsigned char *data, int len, uint64_t now);
+int conn_done(struct replay_conn *c);
+void close_conn(struct replay_conn *c);
+uint64_t now_ns(void);
+int compare_u64(const void *a, const void *b);
+
+/*** Init ***/
+int main(int argc, char *argv[]){
+	if(argc < 3) {
+        printf("Invalid number of arguments, " USAGE);
+        return 1;
+    }
+
+	double speed = 1.0;
+	int fast = 0;
+	for(int i = 2; i < argc; i++){
+		if(strcmp(argv[i], "-u") == 0 && i + 1 < argc) unix_path = argv[++i];
+		else if(strcmp(argv[i], "-x") == 0 && i + 1 < argc) speed = atof(argv[++i]);
+		else if(strcmp(argv[i], "-f") == 0) fast = 1;
+		else if(!port) port = argv[i];
+		else {
+			printf("Unknown option %s, " USAGE, argv[i]);
+			return 1;
+		}
+	}
+	if((!port && !unix_path) || speed <= 0){
+		printf(USAGE);
+		return 1;
+	}
+
+	check(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
+
+	// One descriptor per captured connection
+	struct rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0){
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	load_capture(argv[1]);
+	printf("Replaying %zu events over %u connections.\n", nevents, nconns);
+	fflush(stdout);
+
+	uint64_t start = now_ns();
+
+	for(size_t i = 0; i < nevents; i++){
+		struct event *e = &events[i];
+		struct replay_conn *c = &conns[e->conn];
+
+		if(fast){
+			if(i % SERVICE_EVERY == 0) service(0);
+		}
+		else {
+			uint64_t due = start + (uint64_t)(e->ts / speed);
+			uint64_t now;
+			while((now = now_ns()) < due) service((due - now) / 1000000 + 1);
+		}
+
+		switch(e->type){
+		case CAPTURE_OPEN:
+			open_conn(c);
+			break;
+		case CAPTURE_IN:
+			if(c->fd == -1) break;
+			// Frames must not reach the server before it switched to multiplexing
+			for(uint64_t deadline = now_ns() + WAIT_NS; c->hello && now_ns() < deadline; ) service(10);
+			send_message(c, e, now_ns());
+			break;
+		case CAPTURE_CLOSE:
+			c->closing = 1;
+			c->deadline = now_ns() + WAIT_NS;
+			break;
+		}
+	}
+
+	// Let outstanding replies arrive
+	uint64_t deadline = now_ns() + WAIT_NS;
+	for(int open = 1; open && now_ns() < deadline; ){
+		service(10);
+		open = 0;
+		for(uint32_t i = 1; i <= nconns; i++) open |= conns[i].fd != -1 && !conn_done(&conns[i]);
+	}
+
+	uint64_t elapsed = now_ns() - start;
+
+	uint32_t matched = 0, replayed = 0;
+	uint64_t bytes_received = 0;
+	for(uint32_t i = 1; i <= nconns; i++){
+		struct replay_conn *c = &conns[i];
+		if(!c->opened) continue;
+		replayed++;
+		bytes_received += c->received;
+		if(!c->mismatched && c->received == c->expected_len) matched++;
+		else if(c->mismatched) printf("Connection %u: reply differs at byte %llu\n", i, (unsigned long long)c->mismatch_at);
+		else printf("Connection %u: received %llu of %llu reply bytes\n", i,
+		            (unsigned long long)c->received, (unsigned long long)c->expected_len);
+		if(c->fd != -1) close_conn(c);
+	}
+
+	printf("\nDuration: %.3f s, %llu messages (%.0f/s), %llu bytes sent, %llu bytes received\n",
+	       elapsed / 1e9, (unsigned long long)messages_sent, messages_sent / (elapsed / 1e9),
+	       (unsigned long long)bytes_sent, (unsigned long long)bytes_received);
+	printf("Replies matched (%s): %u of %u connections\n", payloads ? "payload" : "size only", matched, replayed);
+
+	if(nlatencies){
+		qsort(latencies, nlatencies, sizeof *latencies, compare_u64);
+		double p[] = { 50, 90, 99, 99.9 };
+		printf("Latency (us) over %zu replies:", nlatencies);
+		for(int i = 0; i < 4; i++)
+			printf(" p%g %.1f", p[i], latencies[(size_t)(p[i] / 100 * (nlatencies - 1))] / 1000.0);
+		printf(" max %.1f\n", latencies[nlatencies - 1] / 1000.0);
+	}
+
+	return matched == replayed ? 0 : 2;
+}
+
+/*** Capture ***/
+
+/*
+ * Read every event and work out, per message, how many reply bytes answer it.
+ * Replies are attributed to the connection's latest message.
+ */
+void load_capture(const char *path) {
+	FILE *in = fopen(path, "rb");
+	check(in != NULL);
+
+	struct capture_header header;
+	check(fread(&header, sizeof header, 1, in) == 1);
+	if(header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION){
+		fprintf(stderr, "%s is not a capture file of this version\n", path);
+		exit(1);
+	}
+	payloads = header.flags & CAPTURE_PAYLOADS;
+
+	size_t cap = 0;
+	struct capture_record record;
+	while(fread(&record, sizeof record, 1, in) == 1){
+		if(nevents == cap){
+			cap = cap ? cap * 2 : 1024;
+			check((events = realloc(events, cap * sizeof *events)) != NULL);
+		}
+
+		struct event *e = &events[nevents++];
+		e->ts = record.ts;
+		e->conn = record.conn;
+		e->len = record.len;
+		e->type = record.type;
+		e->payload = NULL;
+		if(payloads && record.len > 0){
+			check((e->payload = malloc(record.len)) != NULL);
+			check(fread(e->payload, 1, record.len, in) == record.len);
+		}
+		if(record.conn > nconns) nconns = record.conn;
+	}
+	fclose(in);
+
+	check((conns = calloc(nconns + 1, sizeof *conns)) != NULL);
+
+	size_t *last = calloc(nconns + 1, sizeof *last);     // latest message + 1, per connection
+	check(last != NULL);
+
+	for(size_t i = 0; i < nevents; i++){
+		struct event *e = &events[i];
+		struct replay_conn *c = &conns[e->conn];
+
+		if(e->type == CAPTURE_OUT){
+			if(payloads){
+				check((c->expected = realloc(c->expected, c->expected_len + e->len)) != NULL);
+				memcpy(c->expected + c->expected_len, e->payload, e->len);
+			}
+			c->expected_len += e->len;
+			if(last[e->conn]) events[last[e->conn] - 1].target = c->expected_len;
+		}
+		else if(e->type == CAPTURE_IN){
+			e->before = e->target = c->expected_len;
+			last[e->conn] = i + 1;
+		}
+	}
+	free(last);
+
+	for(uint32_t i = 0; i <= nconns; i++) conns[i].fd = -1;
+}
+
+/*** Connections ***/
+void open_conn(struct replay_conn *c) {
+	int fd;
+
+	if(unix_path){
+		struct sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		check(strlen(unix_path) < sizeof address.sun_path);
+		strcpy(address.sun_path, unix_path);
+
+		check((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1);
+		check(connect(fd, (struct sockaddr *)&address, sizeof address) != -1);
+	}
+	else {
+		struct addrinfo hints, *servinfo;
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;     // the address the server binds to
+
+		check(getaddrinfo(NULL, port, &hints, &servinfo) == 0);
+		check((fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) != -1);
+		check(connect(fd, servinfo->ai_addr, servinfo->ai_addrlen) != -1);
+		freeaddrinfo(servinfo);
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	c->fd = fd;
+	c->opened = 1;
+}
+
+void close_conn(struct replay_conn *c) {
+	close(c->fd);
+	c->fd = -1;
+}
+
+int conn_done(struct replay_conn *c) {
+	return c->received >= c->expected_len && c->outlen == 0;
+}
+
+/*
+ * Send one captured message, synthesized as letters when the capture has no payloads.
+ */
+void send_message(struct replay_conn *c, struct event *e, uint64_t now) {
+	char *data = e->payload;
+
+	if(!data){
+		check((data = malloc(e->len)) != NULL);
+		memset(data, 'A', e->len);
+	}
+
+	// Shared memory cannot be replayed, its messages go over the socket instead
+	if(e->len >= 4 && memcmp(data, "/shm", 4) == 0) goto done;
+	if(e->len >= 4 && memcmp(data, "/mux", 4) == 0) c->mux = c->hello = 1;
+
+	if(e->target > e->before){
+		if(c->npending == c->cap){
+			int cap = c->cap ? c->cap * 2 : 16;
+			struct pending_reply *pending = malloc(cap * sizeof *pending);
+			check(pending != NULL);
+			for(int i = 0; i < c->npending; i++) pending[i] = c->pending[(c->head + i) % c->cap];
+			free(c->pending);
+			c->pending = pending;
+			c->cap = cap;
+			c->head = 0;
+		}
+		c->pending[(c->head + c->npending++) % c->cap] = (struct pending_reply){ now, e->target };
+	}
+
+	int n = 0;
+	if(c->outlen == 0){
+		n = send(c->fd, data, e->len, 0);
+		if(n == -1) n = 0;
+	}
+	if(n < (int)e->len){
+		check((c->out = realloc(c->out, c->outlen + e->len - n)) != NULL);
+		memcpy(c->out + c->outlen, data + n, e->len - n);
+		c->outlen += e->len - n;
+	}
+
+	messages_sent++;
+	bytes_sent += e->len;
+
+done:
+	if(!e->payload) free(data);
+}
+
+/*
+ * Wait up to timeout_ms for replies, finish pending writes and close finished connections.
+ */
+void service(int timeout_ms) {
+	static struct pollfd *fds = NULL;
+	static uint32_t *ids = NULL;
+	static uint32_t cap = 0;
+	unsigned char buf[65536];
+	uint32_t n = 0;
+
+	if(cap < nconns){
+		cap = nconns;
+		check((fds = realloc(fds, cap * sizeof *fds)) != NULL);
+		check((ids = realloc(ids, cap * sizeof *ids)) != NULL);
+	}
+
+	uint64_t now = now_ns();
+	for(uint32_t i = 1; i <= nconns; i++){
+		struct replay_conn *c = &conns[i];
+		if(c->fd == -1) continue;
+		if(c->closing && (conn_done(c) || now > c->deadline)){
+			close_conn(c);
+			continue;
+		}
+		fds[n].fd = c->fd;
+		fds[n].events = POLLIN | (c->outlen ? POLLOUT : 0);
+		ids[n++] = i;
+	}
+
+	if(poll(fds, n, timeout_ms) <= 0) return;
+
+	now = now_ns();
+	for(uint32_t i = 0; i < n; i++){
+		struct replay_conn *c = &conns[ids[i]];
+
+		if(fds[i].revents & POLLOUT){
+			int sent = send(c->fd, c->out, c->outlen, 0);
+			if(sent > 0){
+				memmove(c->out, c->out + sent, c->outlen - sent);
+				c->outlen -= sent;
+			}
+		}
+
+		if(fds[i].revents & (POLLIN | POLLHUP | POLLERR)){
+			int len;
+			while((len = recv(c->fd, buf, sizeof buf, 0)) > 0) feed(c, buf, len, now);
+			if(len == 0 || (len == -1 && errno != EAGAIN)) close_conn(c);
+		}
+	}
+}
+
+/*
+ * Account for received bytes: drop keepalives, compare with the capture, time the replies.
+ */
+void feed(struct replay_conn *c, const unsigned char *data, int len, uint64_t now) {
+	unsigned char reply[65536 + MUX_HEADER];
+	int n = 0;
+
+	for(int i = 0; i < len; ){
+		if(!c->mux){
+			// Keepalive bytes, unless the capture says the reply really holds a zero here
+			uint64_t at = c->received + n;
+			if(data[i] != '\0' || (c->expected && at < c->expected_len && c->expected[at] == '\0'))
+				reply[n++] = data[i];
+			i++;
+		}
+		else if(c->frame_left > 0){
+			uint32_t take = len - i < (int)c->frame_left ? (uint32_t)(len - i) : c->frame_left;
+			memcpy(reply + n, data + i, take);
+			n += take;
+			i += take;
+			c->frame_left -= take;
+		}
+		else {
+			c->hdr[c->hdrlen++] = data[i++];
+			if(c->hdrlen < MUX_HEADER) continue;
+
+			uint32_t stream;
+			uint16_t length;
+			memcpy(&stream, c->hdr, 4);
+			memcpy(&length, c->hdr + 6, 2);
+			c->hdrlen = 0;
+			if(ntohl(stream) == 0 && c->hdr[4] == MUX_PING) continue;
+
+			memcpy(reply + n, c->hdr, MUX_HEADER);
+			n += MUX_HEADER;
+			c->frame_left = ntohs(length);
+			c->hello = 0;
+		}
+	}
+
+	if(c->expected && !c->mismatched){
+		for(int i = 0; i < n; i++){
+			uint64_t at = c->received + i;
+			if(at >= c->expected_len || (unsigned char)c->expected[at] != reply[i]){
+				c->mismatched = 1;
+				c->mismatch_at = at;
+				break;
+			}
+		}
+	}
+	c->received += n;
+
+	while(c->npending && c->received >= c->pending[c->head].target){
+		if(nlatencies == latencies_cap){
+			latencies_cap = latencies_cap ? latencies_cap * 2 : 1024;
+			check((latencies = realloc(latencies, latencies_cap * sizeof *latencies)) != NULL);
+		}
+		latencies[nlatencies++] = now - c->pending[c->head].sent;
+		c->head = (c->head + 1) % c->cap;
+		c->npending--;
+	}
+}
+
+/*** Helpers ***/
+uint64_t now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
@@ -0,0 +1,203 @@
+/*
+** room.c -- broadcast rooms with shared, refcounted fan-out
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+
+#include "room.h"
+
+/*** Data ***/
+static struct room *rooms = NULL;
+static pthread_mutex_t rooms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*** Helpers ***/
+
+/*
+ * Find a room by name, caller holds rooms_lock.
+ */
+static struct room *room_find(const char *name) {
+    for (struct room *r = rooms; r; r = r->next) {
+        if (strcmp(r->name, name) == 0) return r;
+    }
+    return NULL;
+}
+
+/*
+ * Find the group using key or create it, caller holds room->lock.
+ */
+static struct key_group *group_get(struct room *room, const char *key, struct Machine *machine) {
+    struct key_group *g;
+
+    for (g = room->groups; g; g = g->next) {
+        if (strcmp(g->key, key) == 0) return g;
+    }
+
+    g = calloc(1, sizeof *g);
+    if (!g) return NULL;
+    strcpy(g->key, key);
+    g->machine = *machine;
+    g->next = room->groups;
+    room->groups = g;
+
+    return g;
+}
+
+/*
+ * Unlink and free an empty group, caller holds room->lock.
+ */
+static void group_remove(struct room *room, struct key_group *group) {
+    struct key_group **p = &room->groups;
+
+    while (*p != group) p = &(*p)->next;
+    *p = group->next;
+
+    free(group->members);
+    free(group);
+}
+
+/*** Rooms ***/
+
+/*
+ * Join (or create) a room, leaving the current one first.
+ * Members joining with the same key share a keystream.
+ * returns 0 on success, -1 on a bad name or key, or allocation failure.
+ */
+int room_join(struct connection *conn, const char *name, const char *rotors, const char *offsets) {
+    struct Machine machine;
+    char key[ROOM_KEY];
+
+    if (strlen(name) == 0 || strlen(name) >= ROOM_NAME) return -1;
+    if (machine_parse_key(&machine, rotors, offsets) == -1) return -1;
+
+    // Normalized so equal machines land in one group: "321 aaa" and the default key,
+    // or "b", "b321" and "b321 000000"
+    const char *order = rotors ? rotors : "321";
+    char defaults[2 * 8 + 1] = "AAA";
+    if (machine.type == MACHINE_BYTES) {
+        if (!order[1]) order = "b321";
+        int n = 2 * (strlen(order) - 1);
+        memset(defaults, '0', n);
+        defaults[n] = '\0';
+    }
+    if (snprintf(key, sizeof key, "%s %s", order, offsets ? offsets : defaults) >= (int)sizeof key)
+        return -1;
+    for (char *k = key; *k; k++) *k = toupper(*k);
+
+    if (conn->room) room_leave(conn);
+
+    pthread_mutex_lock(&rooms_lock);
+
+    struct room *room = room_find(name);
+    if (!room) {
+        room = calloc(1, sizeof *room);
+        if (!room) {
+            pthread_mutex_unlock(&rooms_lock);
+            return -1;
+        }
+        strcpy(room->name, name);
+        pthread_mutex_init(&room->lock, NULL);
+        room->next = rooms;
+        rooms = room;
+    }
+
+    pthread_mutex_lock(&room->lock);
+
+    struct key_group *g = group_get(room, key, &machine);
+    if (g && g->nmembers == g->capacity) {
+        int capacity = g->capacity ? g->capacity * 2 : 8;
+        struct connection **members = realloc(g->members, capacity * sizeof *members);
+        if (members) {
+            g->members = members;
+            g->capacity = capacity;
+        }
+    }
+    if (!g || g->nmembers == g->capacity) {
+        if (g && g->nmembers == 0) group_remove(room, g);
+        pthread_mutex_unlock(&room->lock);
+        pthread_mutex_unlock(&rooms_lock);
+        return -1;
+    }
+
+    conn->room = room;
+    conn->group = g;
+    conn->slot = g->nmembers;
+    g->members[g->nmembers++] = conn;
+    room->nmembers++;
+
+    pthread_mutex_unlock(&room->lock);
+    pthread_mutex_unlock(&rooms_lock);
+
+    return 0;
+}
+
+/*
+ * Leave the current room, the last member out frees it.
+ */
+void room_leave(struct connection *conn) {
+    struct room *room = conn->room;
+    struct key_group *g = conn->group;
+
+    if (!room) return;
+
+    pthread_mutex_lock(&rooms_lock);
+    pthread_mutex_lock(&room->lock);
+
+    // Swap the last member into our slot
+    struct connection *last = g->members[--g->nmembers];
+    g->members[conn->slot] = last;
+    last->slot = conn->slot;
+    if (g->nmembers == 0) group_remove(room, g);
+
+    conn->room = NULL;
+    conn->group = NULL;
+
+    if (--room->nmembers > 0) {
+        pthread_mutex_unlock(&room->lock);
+        pthread_mutex_unlock(&rooms_lock);
+        return;
+    }
+
+    struct room **p = &rooms;
+    while (*p != room) p = &(*p)->next;
+    *p = room->next;
+
+    pthread_mutex_unlock(&room->lock);
+    pthread_mutex_unlock(&rooms_lock);
+
+    pthread_mutex_destroy(&room->lock);
+    free(room);
+}
+
+/*
+ * Send a plaintext message to every member of the sender's room.
+ * Encrypts once per key group into a single buffer, members only get a reference.
+ * A full queue never blocks the room: the message is dropped for that member,
+ * or the member is disconnected if its queue uses OUTQ_DROP.
+ * returns the number of members the message was queued for.
+ */
+int room_broadcast(struct connection *conn, const char *data, int len) {
+    struct room *room = conn->room;
+    int delivered = 0;
+
+    if (!room) return 0;
+
+    pthread_mutex_lock(&room->lock);
+    for (struct key_group *g = room->groups; g; g = g->next) {
+        struct msgbuf *buf = msgbuf_new(data, len);
+        if (!buf) continue;
+
+        machine_encrypt(&g->machine, buf->data, len);
+
+        for (int i = 0; i < g->nmembers; i++) {
+            if (outq_push(&g->members[i]->outq, buf, 1) == 0) delivered++;
+        }
+
+        msgbuf_unref(buf);
+    }
+    pthread_mutex_unlock(&room->lock);
+
+    return delivered;
+}
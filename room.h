@@ -0,0 +1,37 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <pthread.h>
+
+#include "enigma.h"
+#include "server.h"
+
+#define ROOM_NAME 32
+#define ROOM_KEY 32     // longest key: "b12345678 " and 16 hex digits
+
+/*
+ * Members of a room that share one key, and so one keystream.
+ * A broadcast is encrypted once per group, not once per member.
+ */
+struct key_group {
+    char                key[ROOM_KEY];
+    struct Machine      machine;
+    struct connection   **members;
+    int                 nmembers;
+    int                 capacity;
+    struct key_group    *next;
+};
+
+struct room {
+    char                name[ROOM_NAME];
+    pthread_mutex_t     lock;
+    struct key_group    *groups;
+    int                 nmembers;
+    struct room         *next;
+};
+
+extern int room_join(struct connection *, const char *, const char *, const char *);
+extern void room_leave(struct connection *);
+extern int room_broadcast(struct connection *, const char *, int);
+
+#endif
@@ -19,48 +19,101 @@
 #include <pthread.h>
 #include <signal.h>
 #include <ctype.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 
 /*** Headers ***/
 #include "enigma.h"
+#include "server.h"
+#include "room.h"
+#include "shmring.h"
+#include "trace.h"
+#include "mux.h"
+#include "capture.h"
 
 /*** Defines ***/
 #define BUFFER 2048
 #define QUEUE_LIMIT 10
 #define check(expr) if (!(expr)) { perror(#expr); kill(0, SIGTERM); }
+#define USAGE "program usage: ./server port [-u unix_socket_path] [-q queue_bytes] [-o pause|drop] [-t|-T trace_file] [-c|-C capture_file] [-b]"
 
 /*** Data ***/
 typedef struct pthread_arg_t {
     int accepted_fd;
-    struct sockaddr_in client_address;
-	struct Enigma *machine;
+    struct sockaddr_storage client_address;
+	int local;
+	struct Machine *machine;
 } pthread_arg_t;
 
-struct Rotor new_rotor(struct Enigma *machine, int rotornumber, int offset) {
-    struct Rotor r;
-    r.offset = offset;
-    r.turnnext = 0;
-    r.cipher = rotor_ciphers[rotornumber - 1];
-    r.turnover = rotor_turnovers[rotornumber - 1];
-    r.notch = rotor_notches[rotornumber - 1];
-    machine->numrotors++;
-
-    return r;
-}
+char *unix_path = NULL;
+size_t queue_limit = OUTQ_LIMIT;
+int queue_policy = OUTQ_PAUSE;
+int byte_machine = 0;
+pthread_mutex_t machine_lock = PTHREAD_MUTEX_INITIALIZER;   // the echo machine is shared by every connection
 
 /*** Declarations ***/
-int sendall(int s, char *buf, int *len);
 void *pthread_routine(void *arg);
 void signal_handler(int signal_number);
-void init_enigma(struct Enigma *machine);
-char encryptChar(char c, struct Enigma *machine);
+void init_enigma(struct Machine *machine);
+void handle_message(struct connection *conn, struct Machine *machine, char *message, int len);
+int handle_command(struct connection *conn, const char *message);
+int attach_shm(struct connection *conn);
+int drain_shm(struct connection *conn, struct Machine *machine);
+int conn_write(struct connection *conn, const char *buf, int len);
+int flush_outq(struct connection *conn);
+void remove_unix_path(void);
 
 /*** Init ***/
 int main(int argc, char *argv[]){
-	if(argc != 2) {
-        printf("Invalid number of arguments, program usage: ./server port");
+	if(argc < 2) {
+        printf("Invalid number of arguments, " USAGE);
         return 1;
     }
 	
+	for(int i = 2; i < argc; i++){
+		if(strcmp(argv[i], "-u") == 0 && i + 1 < argc) unix_path = argv[++i];
+		else if(strcmp(argv[i], "-q") == 0 && i + 1 < argc) queue_limit = strtoul(argv[++i], NULL, 10);
+		else if((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-T") == 0) && i + 1 < argc){
+#ifdef TRACE
+			// -t writes the trace out continuously, -T only on SIGUSR1 (and at exit)
+			check(trace_start(argv[i + 1], argv[i][1] == 't' ? TRACE_CONTINUOUS : TRACE_ON_SIGNAL) == 0);
+			check(signal(SIGUSR1, trace_request_dump) != SIG_ERR);
+			i++;
+#else
+			printf("Tracing is not compiled in, rebuild with: make CFLAGS=-DTRACE");
+			return 1;
+#endif
+		}
+		else if(strcmp(argv[i], "-b") == 0) byte_machine = 1;
+		else if((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "-C") == 0) && i + 1 < argc){
+			// -c records payloads too, -C only sizes and timing
+			check(capture_start(argv[i + 1], argv[i][1] == 'c') == 0);
+			i++;
+		}
+		else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc){
+			i++;
+			if(strcmp(argv[i], "pause") == 0) queue_policy = OUTQ_PAUSE;
+			else if(strcmp(argv[i], "drop") == 0) queue_policy = OUTQ_DROP;
+			else {
+				printf("Overflow policy can only be pause or drop");
+				return 1;
+			}
+		}
+		else {
+			printf("Unknown option %s, " USAGE, argv[i]);
+			return 1;
+		}
+	}
+	
+	// A paused connection must still fit the reply to the message it just read
+	if(queue_limit < 2 * BUFFER){
+		printf("Queue limit can only be at least %d bytes", 2 * BUFFER);
+		return 1;
+	}
+	
 	printf("l");
 	
 	int port;
@@ -90,6 +143,26 @@ int main(int argc, char *argv[]){
 	status = listen(socket_fd, QUEUE_LIMIT);
     check(status != -1);
 	
+	// Same-host clients can skip the TCP stack through an AF_UNIX socket
+	int unix_fd = -1;
+	if(unix_path){
+		struct sockaddr_un unix_address = {};
+		unix_address.sun_family = AF_UNIX;
+		check(strlen(unix_path) < sizeof unix_address.sun_path);
+		strcpy(unix_address.sun_path, unix_path);
+		
+		unix_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		check(unix_fd != -1);
+		
+		unlink(unix_path);
+		status = bind(unix_fd, (struct sockaddr *)&unix_address, sizeof unix_address);
+		check(status != -1);
+		atexit(remove_unix_path);
+		
+		status = listen(unix_fd, QUEUE_LIMIT);
+		check(status != -1);
+	}
+	
 	check(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
 	check(signal(SIGTERM, signal_handler) != SIG_ERR);
 	check(signal(SIGINT, signal_handler) != SIG_ERR);
@@ -98,7 +171,7 @@ int main(int argc, char *argv[]){
 	check(pthread_attr_init(&pthread_attr) == 0);
 	check(pthread_attr_setdetachstate(&pthread_attr, PTHREAD_CREATE_DETACHED) == 0);
 	
-	struct Enigma machine = {}; // initialized to defaults
+	struct Machine machine = {}; // initialized to defaults
 	init_enigma(&machine);
 	
     pthread_arg_t *pthread_arg;
@@ -109,31 +182,46 @@ int main(int argc, char *argv[]){
 	printf("Server started.");
 	fflush(stdout);
 	
+	struct pollfd listeners[2];
+	listeners[0].fd = socket_fd;
+	listeners[0].events = POLLIN;
+	listeners[1].fd = unix_fd;      // ignored by poll when -1
+	listeners[1].events = POLLIN;
+	
 	while(1){
-		pthread_arg = (pthread_arg_t *)malloc(sizeof *pthread_arg);
-        if (!pthread_arg) {
-            perror("malloc");
-            continue;
-        }
-		
-		client_address_len = sizeof pthread_arg->client_address;
-        accepted_fd = accept(socket_fd, (struct sockaddr *)&pthread_arg->client_address, &client_address_len);
-        if (accepted_fd == -1) {
-            perror("accept");
-            free(pthread_arg);
-            continue;
-        }
-		
-		pthread_arg->accepted_fd = accepted_fd;
-		
-		pthread_arg->machine = &machine;
-		
-		if (pthread_create(&pthread, &pthread_attr, pthread_routine, (void *)pthread_arg) != 0) {
-            perror("pthread_create");
-            free(pthread_arg);
-            continue;
-        }
+		if(poll(listeners, 2, -1) == -1){
+			if(errno != EINTR) perror("poll");
+			continue;
+		}
 		
+		for(int l = 0; l < 2; l++){
+			if(!(listeners[l].revents & POLLIN)) continue;
+			
+			pthread_arg = (pthread_arg_t *)malloc(sizeof *pthread_arg);
+			if (!pthread_arg) {
+				perror("malloc");
+				continue;
+			}
+			
+			client_address_len = sizeof pthread_arg->client_address;
+			accepted_fd = accept(listeners[l].fd, (struct sockaddr *)&pthread_arg->client_address, &client_address_len);
+			if (accepted_fd == -1) {
+				perror("accept");
+				free(pthread_arg);
+				continue;
+			}
+			
+			pthread_arg->accepted_fd = accepted_fd;
+			pthread_arg->local = listeners[l].fd == unix_fd;
+			
+			pthread_arg->machine = &machine;
+			
+			if (pthread_create(&pthread, &pthread_attr, pthread_routine, (void *)pthread_arg) != 0) {
+				perror("pthread_create");
+				free(pthread_arg);
+				continue;
+			}
+		}
 	}
 	
 	freeaddrinfo(servinfo);
@@ -141,42 +229,101 @@ int main(int argc, char *argv[]){
     return 0;
 }
 
-void init_enigma(struct Enigma *machine){
-	machine->reflector = reflectors[1];
-    machine->rotors[0] = new_rotor(machine, 3, 0);
-    machine->rotors[1] = new_rotor(machine, 2, 0);
-    machine->rotors[2] = new_rotor(machine, 1, 0);
+void init_enigma(struct Machine *machine){
+	// -b switches the echo to the byte alphabet, for binary payloads
+	if(byte_machine){
+		machine_parse_key(machine, "b321", NULL);
+		return;
+	}
+	
+	machine->type = MACHINE_LETTERS;
+	machine->letters.reflector = reflectors[1];
+    machine->letters.rotors[0] = new_rotor(&machine->letters, 3, 0);
+    machine->letters.rotors[1] = new_rotor(&machine->letters, 2, 0);
+    machine->letters.rotors[2] = new_rotor(&machine->letters, 1, 0);
 }
 
 /*** Threads ***/
 void *pthread_routine(void *arg) {
     pthread_arg_t *pthread_arg = (pthread_arg_t *)arg;
     int accepted_fd = pthread_arg->accepted_fd;
-    struct sockaddr_in client_address = pthread_arg->client_address;
+    struct sockaddr_storage client_address = pthread_arg->client_address;
+	
+	struct Machine *machine = pthread_arg->machine;
 	
-	struct Enigma *machine = pthread_arg->machine;
+	struct connection conn = {};
+	conn.fd = accepted_fd;
+	conn.local = pthread_arg->local;
 	
     free(arg);
 	
+	if (outq_init(&conn.outq, queue_limit, queue_policy) == -1) {
+		perror("eventfd");
+		close(accepted_fd);
+		return NULL;
+	}
+	
+	if(capture_enabled) conn.capture_id = capture_open();
+	
 	printf("\nClient connected.");
 	fflush(stdout);
 
 	char c = '\0';
 	int send_limit = 0;
-	int recv_status, send_status;
+	int recv_status, send_status, poll_status;
+	int pending, paused;
 	char message[BUFFER] = {};
-	int bytesleft;
+	uint64_t wakeups;
+	
+	// Writes never block, whatever the client does not take yet waits in conn.outq
+	fcntl(accepted_fd, F_SETFL, fcntl(accepted_fd, F_GETFL) | O_NONBLOCK);
 	
-	struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    setsockopt(accepted_fd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
-    setsockopt(accepted_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+	// The socket carries requests, the eventfd says other members queued room messages for us,
+	// and once attached the shared-memory eventfd says the client submitted into or drained its rings
+	struct pollfd fds[3];
+	fds[0].fd = accepted_fd;
+	fds[1].fd = conn.outq.wakefd;
+	fds[1].events = POLLIN;
+	fds[2].events = POLLIN;
 	
     while(1){
-		recv_status = recv(accepted_fd, &message, BUFFER, 0);
-		if(recv_status == -1){
-			send_status = send(accepted_fd, &c, 1, 0);
+		if(flush_outq(&conn) == -1 || conn.outq.overflowed) break;
+		if(conn.mux && mux_flush(&conn) == -1) break;
+		if(conn.mux && conn.mux->stalled && mux_input(&conn, NULL, 0) == -1) break;
+		
+		// Backpressure: the queue is full once the reply to another message might not fit,
+		// or frames already read still wait for room, then either stop reading until it drains or give up on the client
+		paused = !outq_room(&conn.outq, BUFFER) || (conn.mux && conn.mux->stalled);
+		if(paused && conn.outq.policy == OUTQ_DROP){
+			printf("\nClient overflowed its queue, dropping the connection.");
+			break;
+		}
+		pending = outq_pending(&conn.outq);
+		
+		if(conn.shm && !paused && !shm_ring_empty(&conn.shm->submit)){
+			if(drain_shm(&conn, machine) == -1) break;
+			send_limit = 0;
+			continue;
+		}
+		
+		fds[0].events = (paused ? 0 : POLLIN) | (pending && !conn.shm ? POLLOUT : 0);
+		fds[2].fd = conn.shm ? conn.shm_to_server : -1;
+		
+		poll_status = poll(fds, 3, 1000);
+		if(poll_status == -1){
+			if(errno == EINTR) continue;
+			break;
+		}
+		if(poll_status == 0){
+			// A queue that made no progress for a whole interval counts as a failed send
+			if(pending) send_status = -1;
+			else if(conn.mux){
+				conn.keepalive = 1;
+				send_status = mux_ping(&conn);
+				conn.keepalive = 0;
+			}
+			else send_status = send(accepted_fd, &c, 1, 0);
+			TRACE_POINT(TRACE_KEEPALIVE, accepted_fd, send_status);
 			
 			if(send_status == -1) send_limit++;
 			else send_limit = 0;
@@ -185,23 +332,56 @@ void *pthread_routine(void *arg) {
 			
 			continue;
 		}
-		if(recv_status == 0) break;
 		
-		send_limit = 0;
+		// Queued messages and submissions are picked up at the top of the loop
+		if(fds[1].revents & POLLIN)
+			read(conn.outq.wakefd, &wakeups, sizeof wakeups);
+		if(fds[2].revents & POLLIN)
+			read(conn.shm_to_server, &wakeups, sizeof wakeups);
 		
-		bytesleft = strlen(message);
+		if(fds[0].revents & (POLLHUP | POLLERR)) break;
+		if(!(fds[0].revents & POLLIN)) continue;
 		
-		if(message[0] == '\0') continue;
+		recv_status = recv(accepted_fd, &message, BUFFER - 1, 0);
+		if(recv_status == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+		if(recv_status <= 0) break;
+		TRACE_POINT(TRACE_RECV, accepted_fd, recv_status);
+		if(conn.capture_id) capture_event(conn.capture_id, CAPTURE_IN, message, recv_status);
 		
-		for(int i = 0; i < strlen(message); i++){
-			if(isalpha(message[i]))
-				message[i] = encryptChar(message[i], machine);
-		}
+		send_limit = 0;
 		
-		sendall(accepted_fd, message, &bytesleft);
+		if(conn.mux){
+			if(mux_input(&conn, message, recv_status) == -1) break;
+		}
+		else {
+			handle_message(&conn, machine, message, recv_status);
+			
+			// Frames pipelined behind "/mux" in the same read already belong to the streams,
+			// the command ends at its line break or at the zero bytes that start the first header
+			if(conn.mux){
+				int skip = strcspn(message, "\r\n");
+				if(message[skip] == '\r') skip++;
+				if(message[skip] == '\n') skip++;
+				if(skip < recv_status && mux_input(&conn, message + skip, recv_status - skip) == -1) break;
+			}
+		}
 		bzero(message, BUFFER);
 	}
 	
+	room_leave(&conn);
+	mux_free(conn.mux);
+	
+	if(conn.outq.dropped) printf("\nClient overflowed its queue, %lu messages dropped.", conn.outq.dropped);
+	outq_destroy(&conn.outq);
+	
+	if(conn.shm){
+		shm_rings_unmap(conn.shm);
+		close(conn.shm_to_server);
+		close(conn.shm_to_client);
+	}
+	
+	if(conn.capture_id) capture_event(conn.capture_id, CAPTURE_CLOSE, NULL, 0);
+	
 	printf("\nClient disconnected.");
 	fflush(stdout);
 	
@@ -210,74 +390,233 @@ void *pthread_routine(void *arg) {
     return NULL;
 }
 
-/*** Communication ***/
-int sendall(int s, char *buf, int *len) {
-    int total = 0;        // how many bytes we've sent
-    int bytesleft = *len; // how many we have left to send
-    int n;
-
-    while(total < *len) {
-        n = send(s, buf+total, bytesleft, 0);
-        if (n == -1) { break; }
-        total += n;
-        bytesleft -= n;
-    }
-
-    *len = total; // return number actually sent here
+/*** Messages ***/
 
-    return n==-1?-1:0; // return -1 on failure, 0 on success
+/*
+ * Route one received message: a command, a room broadcast, or the encrypted echo.
+ * message must have room for, and be followed by, a terminating zero.
+ */
+void handle_message(struct connection *conn, struct Machine *machine, char *message, int len) {
+	if(message[0] == '\0' && machine->type == MACHINE_LETTERS) return;
+	
+	if(message[0] == '/' && handle_command(conn, message) == 0) return;
+	
+	if(conn->room){
+		room_broadcast(conn, message, len);
+	}
+	else {
+		pthread_mutex_lock(&machine_lock);
+		machine_encrypt(machine, message, len);
+		pthread_mutex_unlock(&machine_lock);
+		conn_send(conn, message, len);
+	}
 }
 
-/*** Encryption ***/
-char encryptChar(char c, struct Enigma *machine){
+/*
+ * Process the messages the client submitted through shared memory, until the queue fills up.
+ * returns 0 on success, -1 if the client corrupted the ring.
+ */
+int drain_shm(struct connection *conn, struct Machine *machine) {
+	char message[BUFFER];
+	int len = 0;
 	
-    c = toupper(c);
-		
-	// Plugboard
-    int req_index = str_index(alpha, c);
-		
-	// Cycle first rotor before pushing through,
-    rotor_cycle(&machine->rotors[0]);
+	while(outq_room(&conn->outq, BUFFER) &&
+		  (len = shm_ring_read(&conn->shm->submit, message, BUFFER - 1)) > 0){
+		if(len > BUFFER - 1) len = BUFFER - 1;
+		message[len] = '\0';
 		
-	// Double step the rotor
-    if(str_index(machine->rotors[1].notch,
-                alpha[machine->rotors[1].offset]) >= 0 ) {
-        rotor_cycle(&machine->rotors[1]);
-    }
+		// Let a client blocked on a full submit ring retry
+		shm_notify(conn->shm_to_client);
 		
-    // Stepping the rotors
-	for(int i = 0; i < machine->numrotors - 1; i++) {
-        c = alpha[machine->rotors[i].offset];
+		TRACE_POINT(TRACE_RECV, conn->fd, len);
+		if(conn->capture_id) capture_event(conn->capture_id, CAPTURE_IN, message, len);
+		handle_message(conn, machine, message, len);
+	}
+	
+	return len == -1 ? -1 : 0;
+}
 
-        if(machine->rotors[i].turnnext) {
-            machine->rotors[i].turnnext = 0;
-            rotor_cycle(&machine->rotors[i+1]);
-        }
-    }
-		
-	// Pass through all the rotors forward
-    for(int i = 0; i < machine->numrotors; i++) {
-        req_index = rotor_forward(&machine->rotors[i], req_index);
-    }
-		
-	// Pass through the reflector
-	// Inbound
-    c = machine->reflector[req_index];
-    // Outbound
-    req_index = str_index(alpha, c);
-		
-	// Pass back through the rotors in reverse
-    for(int i = machine->numrotors - 1; i >= 0; i--) {
-        req_index = rotor_reverse(&machine->rotors[i], req_index);
-    }
-		
-	// Pass through Plugboard
-	c = alpha[req_index];
+/*** Commands ***/
+
+/*
+ * Room control messages:
+ *   /join <room> [rotors [offsets]]   e.g. "/join lobby 321 AAA"
+ *   /leave
+ * and, on AF_UNIX connections, the switch to shared memory:
+ *   /shm
+ * or the switch to multiplexed streams, see mux.h:
+ *   /mux
+ * returns 0 if handled, -1 otherwise.
+ */
+int handle_command(struct connection *conn, const char *message) {
+	char line[BUFFER];
+	char reply[BUFFER];
+	char *save;
+	int len;
+	
+	// Tokenize a copy, unknown commands are encrypted like any other message
+	strcpy(line, message);
+	line[strcspn(line, "\r\n")] = 0;
+	
+	char *command = strtok_r(line, " ", &save);
+	if(!command) return -1;
+	
+	if(strcmp(command, "/join") == 0){
+		char *name = strtok_r(NULL, " ", &save);
+		char *rotors = strtok_r(NULL, " ", &save);
+		char *offsets = strtok_r(NULL, " ", &save);
 		
-	return c;
+		if(name && room_join(conn, name, rotors, offsets) == 0)
+			len = snprintf(reply, sizeof reply, "Joined %s.", name);
+		else
+			len = snprintf(reply, sizeof reply, "Unable to join, usage: /join room [rotors [offsets]]");
+	}
+	else if(strcmp(command, "/leave") == 0){
+		if(conn->room) {
+			len = snprintf(reply, sizeof reply, "Left %s.", conn->room->name);
+			room_leave(conn);
+		}
+		else
+			len = snprintf(reply, sizeof reply, "Not in a room.");
+	}
+	else if(strcmp(command, "/shm") == 0){
+		if(attach_shm(conn) == 0) return 0;
+		len = snprintf(reply, sizeof reply, "Unable to attach shared memory, it needs a unix socket connection.");
+	}
+	else if(strcmp(command, "/mux") == 0){
+		if(!conn->room && !conn->shm && !conn->mux && (conn->mux = mux_new()) != NULL){
+			mux_hello(conn);
+			return 0;
+		}
+		len = snprintf(reply, sizeof reply, "Unable to multiplex, it needs a socket connection outside of any room.");
+	}
+	else {
+		return -1;
+	}
+	
+	conn_send(conn, reply, len);
+	
+	return 0;
+}
+
+/*
+ * Create the ring pair and eventfds and hand them to the client.
+ * From then on messages and replies travel through the rings, the socket only keeps the connection alive.
+ * returns 0 on success, -1 on failure.
+ */
+int attach_shm(struct connection *conn) {
+	int fds[SHM_NFDS];
+	struct shm_rings *rings;
+	
+	if(!conn->local || conn->shm) return -1;
+	
+	if((rings = shm_rings_create(&fds[SHM_FD_MEM])) == NULL) return -1;
+	fds[SHM_FD_TO_SERVER] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[SHM_FD_TO_CLIENT] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	
+	if(fds[SHM_FD_TO_SERVER] == -1 || fds[SHM_FD_TO_CLIENT] == -1 || shm_send_fds(conn->fd, fds) == -1){
+		shm_rings_unmap(rings);
+		for(int i = 0; i < SHM_NFDS; i++) if(fds[i] != -1) close(fds[i]);
+		return -1;
+	}
+	
+	// The mapping keeps the memory alive
+	close(fds[SHM_FD_MEM]);
+	
+	conn->shm = rings;
+	conn->shm_to_server = fds[SHM_FD_TO_SERVER];
+	conn->shm_to_client = fds[SHM_FD_TO_CLIENT];
+	
+	return 0;
+}
+
+/*** Communication ***/
+
+/*
+ * Write as much of buf as the transport takes right now, without blocking.
+ * The shared-memory ring takes whole messages or nothing.
+ * returns the number of bytes written, -1 if the connection is broken.
+ */
+int conn_write(struct connection *conn, const char *buf, int len) {
+	int n;
+	
+	TRACE_POINT(TRACE_SEND_BEGIN, conn->fd, len);
+	
+	if(conn->shm){
+		n = shm_ring_write(&conn->shm->complete, buf, len) == -1 ? 0 : len;
+		if(n) shm_notify(conn->shm_to_client);
+	}
+	else {
+		n = send(conn->fd, buf, len, MSG_DONTWAIT);
+		if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) n = 0;
+	}
+	
+	TRACE_POINT(TRACE_SEND_END, conn->fd, n);
+	if(conn->capture_id && !conn->keepalive && n > 0) capture_event(conn->capture_id, CAPTURE_OUT, buf, n);
+	
+	return n;
+}
+
+/*
+ * Send a reply, queueing whatever the client cannot take yet.
+ * returns 0 if sent or queued, -1 if the queue overflowed or the connection is broken.
+ */
+int conn_send(struct connection *conn, const char *buf, int len) {
+	int n = 0;
+	
+	// Nothing to keep ordered behind, try the transport directly first
+	if(outq_pending(&conn->outq) == 0){
+		if((n = conn_write(conn, buf, len)) == -1) return -1;
+		if(n == len) return 0;
+	}
+	
+	struct msgbuf *rest = msgbuf_new(buf + n, len - n);
+	if(!rest) return -1;
+	int status = outq_push(&conn->outq, rest, 0);
+	msgbuf_unref(rest);
+	
+	return status;
+}
+
+/*
+ * Send a whole message buffer, queueing a reference instead of a copy when the client is behind.
+ * returns 0 if sent or queued, -1 if the queue overflowed or the connection is broken.
+ */
+int conn_send_buf(struct connection *conn, struct msgbuf *buf) {
+	int n;
+	
+	if(outq_pending(&conn->outq) == 0){
+		if((n = conn_write(conn, buf->data, buf->len)) == -1) return -1;
+		if(n == buf->len) return 0;
+		// Partially written, the rest is copied behind whatever got queued meanwhile
+		if(n > 0) return conn_send(conn, buf->data + n, buf->len - n);
+	}
+	
+	return outq_push(&conn->outq, buf, 0);
+}
+
+/*
+ * Write queued messages until the queue is empty or the transport is full.
+ * returns 0 on success, -1 if the connection is broken.
+ */
+int flush_outq(struct connection *conn) {
+	struct msgbuf *buf;
+	int offset, n;
+	
+	while((buf = outq_peek(&conn->outq, &offset)) != NULL){
+		if((n = conn_write(conn, buf->data + offset, buf->len - offset)) == -1) return -1;
+		if(n == 0) break;
+		outq_advance(&conn->outq, n);
+	}
+	
+	return 0;
 }
 
 /*** Signals ***/
 void signal_handler(int signal_number) {
     exit(0);
+}
+
+void remove_unix_path(void) {
+	unlink(unix_path);
 }
\ No newline at end of file
@@ -5,4 +5,35 @@
 #ifndef LAB1_SERVER_H
 #define LAB1_SERVER_H
 
+#include <stdint.h>
+
+#include "outq.h"
+
+struct room;
+struct key_group;
+struct shm_rings;
+struct mux;
+
+/*
+ * Per-client state, owned by the connection's thread.
+ * Room membership is changed only by the owner, under the room locks.
+ */
+struct connection {
+    int                 fd;
+    int                 local;      // accepted on the AF_UNIX socket
+    struct outq         outq;
+    struct room         *room;
+    struct key_group    *group;
+    int                 slot;       // index in group->members
+    struct shm_rings    *shm;       // NULL unless the client attached shared memory
+    int                 shm_to_server;
+    int                 shm_to_client;
+    struct mux          *mux;       // NULL unless the client switched to multiplexing
+    uint32_t            capture_id; // 0 unless traffic is captured
+    int                 keepalive;  // set while sending a keepalive, which is not captured
+};
+
+extern int conn_send(struct connection *, const char *, int);
+extern int conn_send_buf(struct connection *, struct msgbuf *);
+
 #endif //LAB1_SERVER_H
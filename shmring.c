@@ -0,0 +1,169 @@
+/*
+** shmring.c -- shared-memory rings for same-host clients
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "shmring.h"
+
+#define MASK (SHM_RING_SIZE - 1)
+
+/*
+ * Copy in and out of the ring, wrapping around the end.
+ */
+static void ring_put(struct shm_ring *r, uint32_t pos, const void *src, int len) {
+    uint32_t at = pos & MASK;
+    int first = len < SHM_RING_SIZE - at ? len : SHM_RING_SIZE - at;
+
+    memcpy(r->data + at, src, first);
+    memcpy(r->data, (const char *)src + first, len - first);
+}
+
+static void ring_get(struct shm_ring *r, uint32_t pos, void *dst, int len) {
+    uint32_t at = pos & MASK;
+    int first = len < SHM_RING_SIZE - at ? len : SHM_RING_SIZE - at;
+
+    memcpy(dst, r->data + at, first);
+    memcpy((char *)dst + first, r->data, len - first);
+}
+
+/*
+ * Create a zeroed memfd holding both rings and map it.
+ * returns the mapping and stores the memfd, NULL on failure.
+ */
+struct shm_rings *shm_rings_create(int *memfd) {
+    *memfd = memfd_create("enigma-shm", MFD_CLOEXEC);
+    if (*memfd == -1) return NULL;
+
+    struct shm_rings *rings;
+    if (ftruncate(*memfd, sizeof *rings) == -1 || (rings = shm_rings_map(*memfd)) == NULL) {
+        close(*memfd);
+        return NULL;
+    }
+
+    return rings;
+}
+
+struct shm_rings *shm_rings_map(int memfd) {
+    void *p = mmap(NULL, sizeof(struct shm_rings), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void shm_rings_unmap(struct shm_rings *rings) {
+    munmap(rings, sizeof *rings);
+}
+
+/*
+ * Append one message, all or nothing.
+ * returns len, or -1 if the ring does not have room right now.
+ */
+int shm_ring_write(struct shm_ring *r, const char *buf, int len) {
+    uint32_t head = r->head;
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    uint32_t frame = len;
+
+    if (sizeof frame + len > SHM_RING_SIZE - (head - tail)) return -1;
+
+    ring_put(r, head, &frame, sizeof frame);
+    ring_put(r, head + sizeof frame, buf, len);
+    __atomic_store_n(&r->head, head + sizeof frame + len, __ATOMIC_RELEASE);
+
+    return len;
+}
+
+/*
+ * Take the oldest message, truncated to cap bytes.
+ * head and the frame length come from the peer, so they are checked before use.
+ * returns the stored length, 0 if the ring is empty, -1 if the peer corrupted it.
+ */
+int shm_ring_read(struct shm_ring *r, char *buf, int cap) {
+    uint32_t tail = r->tail;
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint32_t frame;
+
+    if (head == tail) return 0;
+    if (head - tail < sizeof frame || head - tail > SHM_RING_SIZE) return -1;
+
+    ring_get(r, tail, &frame, sizeof frame);
+    if (frame > head - tail - sizeof frame) return -1;
+    ring_get(r, tail + sizeof frame, buf, frame < (uint32_t)cap ? (int)frame : cap);
+    __atomic_store_n(&r->tail, tail + sizeof frame + frame, __ATOMIC_RELEASE);
+
+    return frame;
+}
+
+int shm_ring_empty(struct shm_ring *r) {
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail;
+}
+
+/*
+ * Signal the peer through an eventfd.
+ */
+void shm_notify(int efd) {
+    uint64_t one = 1;
+    write(efd, &one, sizeof one);
+}
+
+/*
+ * Pass the SHM_NFDS descriptors over an AF_UNIX socket.
+ * returns 0 on success, -1 on failure.
+ */
+int shm_send_fds(int sock, const int *fds) {
+    char byte = 'S';
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(SHM_NFDS * sizeof(int))];
+    } control;
+    struct msghdr msg = {};
+
+    memset(&control, 0, sizeof control);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(SHM_NFDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, SHM_NFDS * sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+/*
+ * Receive the descriptors sent by shm_send_fds.
+ * returns 0 on success, -1 on failure.
+ */
+int shm_recv_fds(int sock, int *fds) {
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(SHM_NFDS * sizeof(int))];
+    } control;
+    struct msghdr msg = {};
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+
+    // Keepalive bytes may arrive ahead of the handoff
+    do {
+        msg.msg_controllen = sizeof control.buf;
+        if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0) return -1;
+    } while (byte != 'S');
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(SHM_NFDS * sizeof(int))) return -1;
+    memcpy(fds, CMSG_DATA(cmsg), SHM_NFDS * sizeof(int));
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+
+#define SHM_RING_SIZE (1 << 16)     // bytes of payload space per direction, power of two
+
+/*
+ * Single producer, single consumer byte ring living in a shared memfd.
+ * Messages are framed as a 4 byte length followed by the payload.
+ * head is only written by the producer, tail only by the consumer.
+ */
+struct shm_ring {
+    uint32_t        head;
+    char            pad_head[60];
+    uint32_t        tail;
+    char            pad_tail[60];
+    char            data[SHM_RING_SIZE];
+};
+
+/*
+ * Layout of the shared mapping, one ring per direction.
+ * submit carries plaintext client -> server, complete ciphertext server -> client.
+ */
+struct shm_rings {
+    struct shm_ring submit;
+    struct shm_ring complete;
+};
+
+/*
+ * File descriptors handed to the client over the AF_UNIX socket, in this order.
+ * to_server is signalled by the client after submitting or consuming,
+ * to_client by the server after completing a message.
+ */
+enum { SHM_FD_MEM, SHM_FD_TO_SERVER, SHM_FD_TO_CLIENT, SHM_NFDS };
+
+extern struct shm_rings *shm_rings_create(int *);
+extern struct shm_rings *shm_rings_map(int);
+extern void shm_rings_unmap(struct shm_rings *);
+extern int shm_ring_write(struct shm_ring *, const char *, int);
+extern int shm_ring_read(struct shm_ring *, char *, int);
+extern int shm_ring_empty(struct shm_ring *);
+extern void shm_notify(int);
+extern int shm_send_fds(int, const int *);
+extern int shm_recv_fds(int, int *);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+** trace.c -- per-thread lock-free trace rings
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "trace.h"
+
+/*
+ * One ring per live thread. Only the owner writes records and head,
+ * the drain thread only reads them and advances read.
+ * Rings of exited threads are handed to new threads instead of being freed.
+ */
+struct trace_ring {
+    uint64_t            head;
+    uint64_t            read;
+    int                 owned;
+    struct trace_ring   *next;
+    struct trace_record records[TRACE_RING];
+};
+
+/*** Data ***/
+int trace_enabled = 0;
+
+static struct trace_ring *rings = NULL;
+static __thread struct trace_ring *ring = NULL;
+static __thread uint32_t tid;
+static pthread_key_t ring_key;
+
+static FILE *trace_file = NULL;
+static int trace_mode;
+static volatile sig_atomic_t dump_requested = 0;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long lost = 0;
+
+/*** Rings ***/
+
+static void ring_release(void *r) {
+    __atomic_store_n(&((struct trace_ring *)r)->owned, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Claim a released ring or publish a new one, lock-free.
+ */
+static struct trace_ring *ring_acquire(void) {
+    struct trace_ring *r;
+    int expected;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        expected = 0;
+        if (__atomic_compare_exchange_n(&r->owned, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            goto claimed;
+    }
+
+    if ((r = calloc(1, sizeof *r)) == NULL) return NULL;
+    r->owned = 1;
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+claimed:
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+/*
+ * Append a record to the calling thread's ring, overwriting the oldest.
+ */
+void trace_emit(int event, int conn, uint64_t arg) {
+    struct timespec now;
+
+    if (!ring) {
+        if ((ring = ring_acquire()) == NULL) return;
+        tid = gettid();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t head = ring->head;
+    struct trace_record *rec = &ring->records[head & (TRACE_RING - 1)];
+    rec->ts = now.tv_sec * 1000000000ull + now.tv_nsec;
+    rec->arg = arg;
+    rec->tid = tid;
+    rec->conn = conn;
+    rec->event = event;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*** Draining ***/
+
+/*
+ * Copy every record not written out yet to the trace file.
+ * Records the owner may have overwritten during the copy are discarded.
+ */
+static void trace_drain(void) {
+    static struct trace_record batch[TRACE_RING];
+
+    pthread_mutex_lock(&drain_lock);
+    for (struct trace_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t from = r->read;
+
+        if (head - from > TRACE_RING) {
+            lost += head - from - TRACE_RING;
+            from = head - TRACE_RING;
+        }
+        uint64_t base = from;
+        for (uint64_t i = from; i < head; i++)
+            batch[i - base] = r->records[i & (TRACE_RING - 1)];
+
+        // The owner may be rewriting slot now, which held record now - TRACE_RING
+        uint64_t now = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (now >= TRACE_RING && now - TRACE_RING + 1 > from) {
+            uint64_t valid = now - TRACE_RING + 1 < head ? now - TRACE_RING + 1 : head;
+            lost += valid - from;
+            from = valid;
+        }
+
+        if (head > from) fwrite(&batch[from - base], sizeof batch[0], head - from, trace_file);
+        r->read = head;
+    }
+    fflush(trace_file);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void *trace_routine(void *arg) {
+    struct timespec interval = { 0, 100 * 1000000 };
+
+    while (1) {
+        nanosleep(&interval, NULL);
+        if (trace_mode == TRACE_CONTINUOUS || dump_requested) {
+            dump_requested = 0;
+            trace_drain();
+        }
+    }
+
+    return NULL;
+}
+
+static void trace_stop(void) {
+    trace_enabled = 0;
+    trace_drain();
+    if (lost && trace_mode == TRACE_CONTINUOUS) fprintf(stderr, "\ntrace: %lu records overwritten before they were written out\n", lost);
+    fclose(trace_file);
+}
+
+/*
+ * Enable tracing into path.
+ * TRACE_CONTINUOUS writes records out every 100 ms, TRACE_ON_SIGNAL only
+ * when trace_request_dump is called (from a signal handler), so the rings
+ * act as a flight recorder of the last TRACE_RING events per thread.
+ * Whatever is left is written out at exit.
+ * returns 0 on success, -1 on failure.
+ */
+int trace_start(const char *path, int mode) {
+    struct trace_header header = { TRACE_MAGIC, TRACE_VERSION, sizeof(struct trace_record) };
+    pthread_t pthread;
+
+    if ((trace_file = fopen(path, "wb")) == NULL) return -1;
+    if (fwrite(&header, sizeof header, 1, trace_file) != 1) return -1;
+
+    trace_mode = mode;
+    if (pthread_key_create(&ring_key, ring_release) != 0) return -1;
+    if (pthread_create(&pthread, NULL, trace_routine, NULL) != 0) return -1;
+    pthread_detach(pthread);
+    atexit(trace_stop);
+
+    trace_enabled = 1;
+
+    return 0;
+}
+
+/*
+ * Async-signal-safe, the dump happens on the drain thread.
+ */
+void trace_request_dump(int signal_number) {
+    dump_requested = 1;
+}
@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Hot-path trace points, compiled in with -DTRACE and enabled at run time.
+ * Each thread writes fixed-size records into its own ring, a background
+ * thread drains the rings into a file that trace2json turns into Chrome trace JSON.
+ */
+
+#define TRACE_MAGIC 0x43525445     // "ETRC"
+#define TRACE_VERSION 1
+#define TRACE_RING 1024             // records per thread, power of two
+
+enum trace_event {
+    TRACE_RECV,             // message received, arg = bytes
+    TRACE_ENCRYPT_BEGIN,    // arg = bytes
+    TRACE_ENCRYPT_END,
+    TRACE_SEND_BEGIN,       // arg = bytes offered
+    TRACE_SEND_END,         // arg = bytes written
+    TRACE_KEEPALIVE,        // arg = send status
+    TRACE_NEVENTS
+};
+
+// Dump modes
+enum { TRACE_CONTINUOUS, TRACE_ON_SIGNAL };
+
+struct trace_header {
+    uint32_t        magic;
+    uint16_t        version;
+    uint16_t        record_size;
+};
+
+struct trace_record {
+    uint64_t        ts;         // CLOCK_MONOTONIC, ns
+    uint64_t        arg;
+    uint32_t        tid;
+    int32_t         conn;       // socket of the connection, -1 if none
+    uint16_t        event;
+    uint16_t        pad[3];
+};
+
+#ifdef TRACE
+extern int trace_enabled;
+
+#define TRACE_POINT(event, conn, arg) \
+    do { if (__builtin_expect(trace_enabled, 0)) trace_emit((event), (conn), (arg)); } while (0)
+#else
+#define TRACE_POINT(event, conn, arg) do { } while (0)
+#endif
+
+extern void trace_emit(int, int, uint64_t);
+extern int trace_start(const char *, int);
+extern void trace_request_dump(int);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+** trace2json.c -- convert a server trace dump into Chrome trace / Perfetto JSON
+*/
+
+/*** Libraries ***/
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+/*** Headers ***/
+#include "trace.h"
+
+/*** Data ***/
+static const char *names[TRACE_NEVENTS] = {
+    [TRACE_RECV]            = "recv",
+    [TRACE_ENCRYPT_BEGIN]   = "encrypt",
+    [TRACE_ENCRYPT_END]     = "encrypt",
+    [TRACE_SEND_BEGIN]      = "send",
+    [TRACE_SEND_END]        = "send",
+    [TRACE_KEEPALIVE]       = "keepalive",
+};
+
+// Instant events, or the begin / end of a duration
+static const char phases[TRACE_NEVENTS] = {
+    [TRACE_RECV]            = 'i',
+    [TRACE_ENCRYPT_BEGIN]   = 'B',
+    [TRACE_ENCRYPT_END]     = 'E',
+    [TRACE_SEND_BEGIN]      = 'B',
+    [TRACE_SEND_END]        = 'E',
+    [TRACE_KEEPALIVE]       = 'i',
+};
+
+/*** Init ***/
+int main(int argc, char *argv[]){
+    if(argc != 2) {
+        printf("Invalid number of arguments, program usage: ./trace2json trace_file > trace.json");
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if(!in) {
+        perror("fopen");
+        return 1;
+    }
+
+    struct trace_header header;
+    if(fread(&header, sizeof header, 1, in) != 1 || header.magic != TRACE_MAGIC ||
+       header.version != TRACE_VERSION || header.record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s is not a trace file of this version\n", argv[1]);
+        return 1;
+    }
+
+    struct trace_record rec;
+    uint64_t origin = 0;
+    int first = 1;
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    while(fread(&rec, sizeof rec, 1, in) == 1) {
+        if(rec.event >= TRACE_NEVENTS) continue;
+        if(first) origin = rec.ts;
+
+        // Timestamps are microseconds in the JSON format
+        printf("%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%" PRIu32,
+               first ? "" : ",", names[rec.event], phases[rec.event],
+               (double)(int64_t)(rec.ts - origin) / 1000.0, rec.tid);
+        if(phases[rec.event] == 'i') printf(",\"s\":\"t\"");
+        printf(",\"args\":{\"conn\":%" PRId32 ",\"value\":%" PRId64 "}}", rec.conn, (int64_t)rec.arg);
+        first = 0;
+    }
+    printf("\n]}\n");
+
+    fclose(in);
+
+    return 0;
+}